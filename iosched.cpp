@@ -1,607 +1,1807 @@
+// iosched : command line driver of libiosched. Simulates the schedulers on traces of IO operations (see the README).
+// The pool, the loaders, the schedulers and the simulator are in iosched_core.h and libiosched.cpp.
+
 #include <ctype.h>
-#include <stdio.h>
-#include <stdlib.h>
+#include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <random>
+#include <set>
+
+#include "iosched_core.h"
+
+//-------------------- STEP 6 : Sweep many (scheduler, trace) combinations in parallel --------------------
+// Instead of running iosched once per scheduler and per input file like runit.sh, the sweep mode (-w flag) runs
+// all the combinations in one process, on a pool of threads. Each trace is loaded once and shared read-only :
+// every simulation owns its scheduler, its input hand and its results, so nothing is shared between them.
+
+// Load a whole trace in the pool with the loader chosen by the flags
+bool load_trace(const char* path, IO_pool& io_ops, bool binary, bool mmapped) {
+    if (binary) {
+        return loadBinaryInput(path, io_ops);
+    }
+    if (mmapped) {
+        return loadInput(path, io_ops);
+    }
+    ifstream input_file(path);
+    if ( !input_file.is_open() ) {
+        return false;
+    }
+    return readInput(input_file, io_ops);
+}
+
+void run_simulation(Simulator& simulator, bool event_driven) {
+    if (event_driven) {
+        simulator.event_simulation();
+    } else {
+        simulator.simulation();
+    }
+}
 
-#include <sstream>
-#include <iostream>
-#include <fstream>
-#include <string>
-#include <queue>
-#include <stack>
-#include <map>
-#include <list>
-
-using namespace std;
-
-//-------------------- STEP 1 : Create the IO operation structure --------------------
-struct IO_op {
-    int oid; // id of the operation. Could also use the arrival_time since there are no overlap
-    int arrival_time; // time when IO operation is issued
-    int track; // track that is accessed
-
-    bool isCompleted; // check if the IO_operation is completed
-    int start_time; // time when the IO operation starts
-    int end_time; // time when the IO operation ends
-    int turnaround_time; // turn around time. Used to compute summary
-    int wait_time; // wait time from being submitted to start being executed
-
-    IO_op(int oid_, int arrival_time_, int track_) {
-        oid = oid_;
-        arrival_time = arrival_time_;
-        track = track_;
-
-        isCompleted = false;
-        start_time = -1;
-        end_time = -1;
-        turnaround_time = -1;
+// False, with an error on the standard error, if the simulation stopped on an IO operation ending after MAX_TIME
+bool check_end_times(const Simulator& simulator) {
+    if (simulator.overflow_io_op == NO_OP) {
+        return true;
+    }
+    fprintf(stderr, "IO operation %d ends after time %lld (see the large-disk mode in the README)\n",
+            simulator.io_ops->oid[simulator.overflow_io_op], (long long) MAX_TIME);
+    return false;
+}
+
+// Run job(0) ... job(nb_jobs - 1) on nb_threads threads
+template <class Job>
+void parallel_for(int nb_jobs, int nb_threads, Job job) {
+    atomic<int> next_job(0);
+    vector<thread> threads;
+    for (int t = 0; t < nb_threads && t < nb_jobs; t++) {
+        threads.push_back(thread([&]() {
+            for (int j = next_job++; j < nb_jobs; j = next_job++) {
+                job(j);
+            }
+        }));
+    }
+    for (size_t t = 0; t < threads.size(); t++) {
+        threads[t].join();
+    }
+}
+
+// Name of a trace in the output files, like runit.sh : "inputs/input3" gives "3"
+string trace_name(const char* path) {
+    string name(path);
+    size_t slash = name.find_last_of('/');
+    if (slash != string::npos) {
+        name = name.substr(slash + 1);
+    }
+    if (name.size() > 5 && name.compare(0, 5, "input") == 0) {
+        name = name.substr(5);
+    }
+    return name;
+}
+
+// Simulate every scheduler of algos on every trace. The output of each combination goes to <outdir>/out_<trace>_<algo>
+// Return the number of combinations that failed
+int sweep(char** traces, int nb_traces, const char* algos, const char* outdir, int nb_threads,
+          char backend, const SchedulerConfig& config, bool event_driven, bool binary, bool mmapped) {
+    struct timespec start, stop;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // First, load all the traces
+    vector<IO_pool> io_ops(nb_traces);
+    vector<char> loaded(nb_traces);
+    parallel_for(nb_traces, nb_threads, [&](int t) {
+        loaded[t] = load_trace(traces[t], io_ops[t], binary, mmapped);
+    });
+
+    // Then run one simulation per (trace, scheduler)
+    int nb_algos = strlen(algos);
+    atomic<int> nb_failed(0);
+    parallel_for(nb_traces * nb_algos, nb_threads, [&](int j) {
+        int t = j / nb_algos;
+        char algo = algos[j % nb_algos];
+        string output_path = string(outdir) + "/out_" + trace_name(traces[t]) + "_" + algo;
+
+        Scheduler* scheduler = new_scheduler(algo, &io_ops[t], backend, config);
+        FILE* output = fopen(output_path.c_str(), "w");
+        if ( !loaded[t] || scheduler == NULL || output == NULL ) {
+            fprintf(stderr, "Could not simulate %s with scheduler %c\n", traces[t], algo);
+            nb_failed++;
+        } else {
+            VectorInput input(&io_ops[t]);
+            Simulator simulator = Simulator(scheduler, &io_ops[t], &input, false, output);
+            simulator.cost_model = config.cost_model;
+            run_simulation(simulator, event_driven);
+            if (check_end_times(simulator)) {
+                simulator.print_summary();
+            } else {
+                fprintf(stderr, "Could not simulate %s with scheduler %c\n", traces[t], algo);
+                nb_failed++;
+            }
+        }
+        if (output != NULL) {
+            fclose(output);
+        }
+        delete scheduler;
+    });
+
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    double seconds = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "sweep : %d simulations on %d threads in %.3lf s\n", nb_traces * nb_algos, nb_threads, seconds);
+    return nb_failed;
+}
+
+
+
+//-------------------- STEP 7 : Synthetic workloads and benchmarks --------------------
+// The generator (-G flag) writes a trace in the same format as the io generator of the inputs/ files.
+// Four workloads are available :
+//   - poisson : arrivals follow a Poisson process of rate lambda, tracks are uniform
+//   - bursty : same average rate, but the requests come in bursts of back to back arrivals separated by long gaps
+//   - hotspot : Poisson arrivals, but 80% of the requests go to a hot region covering 10% of the tracks
+//   - tenants : Poisson arrivals from two streams (4th column). 90% of the requests come from a sequential scanner
+//     (stream 0) reading the tracks in order and wrapping around, the others from a random reader (stream 1)
+// Arrival times are strictly increasing, like in the inputs/ files.
+
+struct Workload {
+    string distribution;
+    int numio;
+    int maxtracks;
+    double lambda;
+    unsigned seed;
+
+    Workload() {
+        distribution = "poisson";
+        numio = 10;
+        maxtracks = 128;
+        lambda = 0.1;
+        seed = 1;
     }
 };
 
+// Parse "<distribution>,<numio>,<maxtracks>,<lambda>[,<seed>]". Missing fields keep their default value
+bool parse_workload(const char* spec, Workload& workload) {
+    char distribution[32];
+    int nb_fields = sscanf(spec, "%31[a-z],%d,%d,%lf,%u", distribution, &workload.numio, &workload.maxtracks,
+                           &workload.lambda, &workload.seed);
+    if (nb_fields < 1) {
+        return false;
+    }
+    workload.distribution = distribution;
+    return (workload.distribution == "poisson" || workload.distribution == "bursty" || workload.distribution == "hotspot"
+            || workload.distribution == "tenants")
+        && workload.numio > 0 && workload.maxtracks > 0 && workload.lambda > 0;
+}
+
+// Generate the workload directly in a pool (op_index == oid, like readInput())
+void generate_workload(const Workload& workload, IO_pool& io_ops) {
+    mt19937 rng(workload.seed);
+    exponential_distribution<double> inter_arrival(workload.lambda);
+    uniform_int_distribution<int> any_track(0, workload.maxtracks - 1);
+    uniform_int_distribution<int> hot_track(0, max(workload.maxtracks / 10, 1) - 1);
+    uniform_real_distribution<double> coin(0, 1);
+    const int burst_length = 16;
+
+    io_ops.reserve(workload.numio);
+    double time = 0;
+    int arrival_time = 0;
+    int scanner_track = 0;
+    for (int oid = 0; oid < workload.numio; oid++) {
+        if (workload.distribution == "bursty") {
+            // A whole burst worth of inter-arrival time before the first request of each burst, then 1 time unit
+            if (oid % burst_length == 0) {
+                for (int i = 0; i < burst_length; i++) {
+                    time += inter_arrival(rng);
+                }
+            } else {
+                time += 1;
+            }
+        } else {
+            time += inter_arrival(rng);
+        }
+        arrival_time = max(arrival_time + 1, (int) time);
+        time = max(time, (double) arrival_time);
 
-//-------------------- STEP 2 : Read Input File and initialize the IO operations queue --------------------
-// Now, we can read the input file and initialize the IO operations queue
-
-// We choose vector over queue because we wanna keep the input for the summary
-vector<IO_op*> IO_ops_input_queue; // vector of all the IO operations in order of their appearance. 
-int hand_input = 0; // index of current input IO operation. Used to imitate the behavior of a queue
-int size_IO_ops_input_queue;
-
-void readInput(istream& input_file) {
-    
-    string line;
-    // We skip the first comments lines
-    while (getline(input_file, line)) {
-        if (line[0] != '#') {
-            break;
+        int track = any_track(rng);
+        if (workload.distribution == "hotspot" && coin(rng) < 0.8) {
+            track = hot_track(rng);
+        }
+        op_index io_op = io_ops.alloc(oid, arrival_time, track);
+        if (workload.distribution == "tenants") {
+            bool scanner = coin(rng) < 0.9;
+            if (scanner) {
+                io_ops.track[io_op] = scanner_track;
+                scanner_track = (scanner_track + 1) % workload.maxtracks;
+            }
+            io_ops.set_stream(io_op, scanner ? 0 : 1);
         }
     }
+}
+
+void write_workload(const Workload& workload, IO_pool& io_ops, FILE* file) {
+    fprintf(file, "#io generator %s seed=%u\n", workload.distribution.c_str(), workload.seed);
+    fprintf(file, "#numio=%d maxtracks=%d lambda=%lf\n", workload.numio, workload.maxtracks, workload.lambda);
+    for (op_index io_op = 0; io_op < io_ops.size(); io_op++) {
+        fprintf(file, "%lld %lld", (long long) io_ops.arrival_time[io_op], (long long) io_ops.track[io_op]);
+        if ( !io_ops.stream.empty() ) {
+            fprintf(file, " 0 %d", io_ops.stream_of(io_op)); // device 0 : the stream is the 4th column
+        }
+        fprintf(file, "\n");
+    }
+}
+
+
+// The benchmark (-x flag) writes a CSV with two kinds of measures, for each scheduler and request queue backend :
+//   - dispatch : the request queue is kept at a fixed depth, we time strategy() + add_request() alone.
+//     Swept over the queue depth and the number of tracks.
+//   - simulation : a whole event-driven simulation of a generated workload, in IO operations per second.
+//     Swept over the workload, the trace length and the number of tracks.
+// The vector scan backend is O(n) per dispatch, so it is skipped on the largest configurations to keep the run short.
+
+double elapsed_ns(struct timespec& start) {
+    struct timespec stop;
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    return (stop.tv_sec - start.tv_sec) * 1e9 + (stop.tv_nsec - start.tv_nsec);
+}
+
+// Return the average ns per strategy() call with queue_depth pending requests
+double bench_dispatch(char algo, char backend, int queue_depth, int maxtracks, int nb_dispatch) {
+    IO_pool io_ops;
+    mt19937 rng(queue_depth);
+    uniform_int_distribution<int> any_track(0, maxtracks - 1);
+    io_ops.reserve(queue_depth + nb_dispatch);
+    for (int oid = 0; oid < queue_depth + nb_dispatch; oid++) {
+        io_ops.alloc(oid, oid, any_track(rng));
+    }
 
-    double arrival_time, track;
-
-    int count= 0; // Same as oid. We use the order of arrival as the oid of the IO operation
-    // We process the first io_operation manually because it is not taken into account in the future while loop
-    istringstream issVMA(line);
-    issVMA >> arrival_time >> track;    
-    IO_ops_input_queue.push_back( new IO_op(count, arrival_time, track) );
-    count++;
-    while ( input_file >> arrival_time >> track ) {
-        IO_op* io_op = new IO_op(count, arrival_time, track);
-        IO_ops_input_queue.push_back(io_op);
-        count++;
+    Scheduler* scheduler = new_scheduler(algo, &io_ops, backend);
+    op_index hand = 0;
+    for (; hand < (op_index) queue_depth; hand++) {
+        scheduler->add_request(hand);
     }
-    size_IO_ops_input_queue = count;
 
-};
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < nb_dispatch; i++) {
+        scheduler->clock = hand; // the arrival time of the next request
+        op_index io_op = scheduler->strategy();
+        // The head ends on the track of the dispatched request, and a new request replaces it
+        scheduler->head = io_ops.track[io_op];
+        scheduler->add_request(hand++);
+    }
+    double ns = elapsed_ns(start);
+    delete scheduler;
+    return ns / nb_dispatch;
+}
+
+// Return the number of IO operations simulated per second
+double bench_simulation(char algo, char backend, IO_pool& io_ops) {
+    Scheduler* scheduler = new_scheduler(algo, &io_ops, backend);
+    VectorInput input(&io_ops);
+    Simulator simulator = Simulator(scheduler, &io_ops, &input, false);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    simulator.event_simulation();
+    double ns = elapsed_ns(start);
+    delete scheduler;
+    return io_ops.size() / (ns / 1e9);
+}
+
+int benchmark(const char* csv_path) {
+    FILE* csv = fopen(csv_path, "w");
+    if (csv == NULL) {
+        return -1;
+    }
+    fprintf(csv, "kind,scheduler,backend,workload,numio,maxtracks,queue_depth,ns_per_dispatch,ops_per_sec\n");
+
+    const char algos[] = "ijscfdaw";
+    const char backends[] = "vtsh";
+    const int queue_depths[] = {16, 256, 4096, 65536, 1 << 20};
+    const int maxtracks[] = {128, 4096, 1 << 20};
+    const int trace_lengths[] = {1000, 10000, 100000};
+    const char* distributions[] = {"poisson", "bursty", "hotspot"};
+
+    for (int a = 0; algos[a] != '\0'; a++) {
+        for (int b = 0; backends[b] != '\0'; b++) {
+            // FIFO, DEADLINE and SATF don't use the request queue backends
+            if (strchr("ida", algos[a]) != NULL && backends[b] != 'v') {
+                continue;
+            }
+            for (int d = 0; d < 5; d++) {
+                for (int t = 0; t < 3; t++) {
+                    int nb_dispatch = max(1000, min(100000, (1 << 26) / queue_depths[d]));
+                    double ns = bench_dispatch(algos[a], backends[b], queue_depths[d], maxtracks[t], nb_dispatch);
+                    fprintf(csv, "dispatch,%c,%c,uniform,%d,%d,%d,%.1lf,%.0lf\n", algos[a], backends[b],
+                            nb_dispatch, maxtracks[t], queue_depths[d], ns, 1e9 / ns);
+                }
+            }
+        }
+    }
 
+    for (int w = 0; w < 3; w++) {
+        for (int n = 0; n < 3; n++) {
+            for (int t = 0; t < 3; t++) {
+                Workload workload;
+                workload.distribution = distributions[w];
+                workload.numio = trace_lengths[n];
+                workload.maxtracks = maxtracks[t];
+                IO_pool io_ops;
+                generate_workload(workload, io_ops);
+
+                for (int a = 0; algos[a] != '\0'; a++) {
+                    for (int b = 0; backends[b] != '\0'; b++) {
+                        bool has_backend = strchr("ida", algos[a]) == NULL;
+                        if ( (!has_backend && backends[b] != 'v') || (backends[b] == 'v' && has_backend && workload.numio > 10000) ) {
+                            continue;
+                        }
+                        double ops_per_sec = bench_simulation(algos[a], backends[b], io_ops);
+                        fprintf(csv, "simulation,%c,%c,%s,%d,%d,,,%.0lf\n", algos[a], backends[b],
+                                workload.distribution.c_str(), workload.numio, workload.maxtracks, ops_per_sec);
+                    }
+                }
+            }
+        }
+    }
 
-//-------------------- STEP 3 : Create Abstract class for Scheduler Algorithms --------------------
+    fclose(csv);
+    return 0;
+}
 
-class Scheduler {
-    public:
-        int head;
-        IO_op* curr_io_op;
 
-        virtual IO_op* strategy() = 0; // Choose next IO operation given the request queue. To be implemented by each scheduler
-        virtual void move_head() = 0; // Move head. To be implemented by each scheduler
-        virtual void add_request() = 0; // Add next input IO operation to request queue. Scheduler dependant because it depends on if the request queue is a queue, a vector etc
-        virtual bool hasRequest() = 0; // Check if the request queue is empty or not. Scheduler dependant because it depends on if the request queue is a queue or a vector etc
 
-        Scheduler() {
-            head = 0;
-            curr_io_op = NULL;
-        }
+//-------------------- STEP 8 : Multi-device simulation --------------------
+// The multi-device mode (-d flag) stripes the IO operations over several disks. Each device has its own scheduler and
+// its own head. The device of an IO operation is the 3rd column of the input when there is one (below the number of
+// devices of -d), otherwise it comes from the striping rule : stripes of <stripe> consecutive tracks are spread
+// round-robin over the devices.
+// The devices share nothing but the clock : no IO operation ever moves from a device to another, so each device can
+// run its own event-driven simulation on its own thread, from time 1 to its last completion, without any lock.
+// Each device then gets its SUM line, and the last SUM line aggregates all of them.
 
+struct DeviceTrace {
+    IO_pool io_ops; // IO operations of the device, with their global oid and the track local to the device
+    vector<op_index> global; // global op_index of each IO operation of the device
 };
 
-//-------------------- STEP 4 : Create the different Scheduler Algorithms --------------------
+int multi_device(const IO_pool& io_ops, int nb_devices, int stripe, char algo, char backend, const SchedulerConfig& config,
+                 int nb_threads, bool percentiles) {
+    bool has_device_column = !io_ops.device.empty();
+    if (has_device_column) {
+        for (op_index io_op = 0; io_op < io_ops.size(); io_op++) {
+            if (io_ops.device_of(io_op) >= nb_devices) {
+                fprintf(stderr, "IO operation %d is on device %d, but -d gives %d devices\n", io_ops.oid[io_op],
+                        io_ops.device_of(io_op), nb_devices);
+                return -1;
+            }
+        }
+    }
 
-class FIFO: public Scheduler {
-    queue<IO_op*> request_queue;
+    // Split the trace : each device gets its IO operations, in the same order
+    vector<DeviceTrace> devices(nb_devices);
+    for (op_index io_op = 0; io_op < io_ops.size(); io_op++) {
+        io_track track = io_ops.track[io_op];
+        int device = io_ops.device_of(io_op);
+        if (!has_device_column) {
+            device = (int) ((track / stripe) % nb_devices);
+            track = (track / (stripe * nb_devices)) * stripe + track % stripe;
+        }
+        op_index local = devices[device].io_ops.alloc(io_ops.oid[io_op], io_ops.arrival_time[io_op], track);
+        if ( !io_ops.stream.empty() ) {
+            devices[device].io_ops.set_stream(local, io_ops.stream_of(io_op));
+        }
+        devices[device].global.push_back(io_op);
+    }
 
-    IO_op* strategy() {
-        if (request_queue.empty()) {
-                return NULL;
+    // Simulate all the devices in parallel
+    vector<Simulator*> simulators(nb_devices, (Simulator*) NULL);
+    vector<Scheduler*> schedulers(nb_devices, (Scheduler*) NULL);
+    vector<VectorInput*> inputs(nb_devices, (VectorInput*) NULL);
+    for (int d = 0; d < nb_devices; d++) {
+        schedulers[d] = new_scheduler(algo, &devices[d].io_ops, backend, config);
+        if (schedulers[d] == NULL) {
+            printf("Please give a scheduler with -s among i, j, s, c, f, d, a and w\n");
+            return -1;
+        }
+        inputs[d] = new VectorInput(&devices[d].io_ops);
+        simulators[d] = new Simulator(schedulers[d], &devices[d].io_ops, inputs[d], false);
+        simulators[d]->cost_model = config.cost_model;
+    }
+    parallel_for(nb_devices, nb_threads, [&](int d) {
+        if (devices[d].io_ops.size() > 0) {
+            simulators[d]->event_simulation();
         } else {
-            IO_op* next_io_op = request_queue.front();
-            request_queue.pop();
-            curr_io_op = next_io_op;
-            return next_io_op;
+            simulators[d]->CLOCK = 0;
         }
+    });
+    bool end_times_ok = true;
+    for (int d = 0; d < nb_devices; d++) {
+        end_times_ok = check_end_times(*simulators[d]) && end_times_ok;
+    }
+    if (!end_times_ok) {
+        return -1;
     }
 
-    // Move head toward a target track
-    void move_head() {
-        if ( head < curr_io_op->track ) {
-            head++;
-        } else {
-            head--;
+    // Gather the results in the global oid order
+    vector<IO_result> results(io_ops.size());
+    for (int d = 0; d < nb_devices; d++) {
+        for (op_index io_op = 0; io_op < devices[d].io_ops.size(); io_op++) {
+            results[devices[d].global[io_op]] = simulators[d]->results[io_op];
         }
-        if (head == curr_io_op->track) {
-            curr_io_op->isCompleted = true;
+    }
+    for (op_index io_op = 0; io_op < io_ops.size(); io_op++) {
+        printf("%5d: %5lld %5lld %5lld\n", io_ops.oid[io_op], (long long) io_ops.arrival_time[io_op],
+               (long long) results[io_op].start_time, (long long) results[io_op].end_time);
+    }
+
+    // SUM line per device, then the aggregate one
+    io_time clock = 0;
+    long long tot_movement = 0;
+    double tot_turnaround = 0, tot_wait_time = 0;
+    io_time max_wait_time = 0;
+    Histogram wait_histogram, turnaround_histogram, seek_histogram;
+    map<int, StreamSummary> streams; // a stream can have IO operations on every device
+    for (int d = 0; d < nb_devices; d++) {
+        Simulator* simulator = simulators[d];
+        int nb_io_ops = max(simulator->nb_io_ops, 1);
+        printf("SUM[%d]: %lld %lld %.2lf %.2lf %lld\n", d, (long long) simulator->CLOCK, (long long) simulator->tot_movement,
+               simulator->avg_turnaround / nb_io_ops, simulator->avg_wait_time / nb_io_ops, (long long) simulator->max_wait_time);
+
+        clock = max(clock, simulator->CLOCK);
+        tot_movement += simulator->tot_movement;
+        tot_turnaround += simulator->avg_turnaround;
+        tot_wait_time += simulator->avg_wait_time;
+        max_wait_time = max(max_wait_time, simulator->max_wait_time);
+        wait_histogram.add(simulator->wait_histogram);
+        turnaround_histogram.add(simulator->turnaround_histogram);
+        seek_histogram.add(simulator->seek_histogram);
+        for (map<int, StreamSummary>::iterator it = simulator->streams.begin(); it != simulator->streams.end(); it++) {
+            streams[it->first].add(it->second);
         }
-    };
 
-    void add_request() {
-        IO_op* next_io_op_input = IO_ops_input_queue[hand_input];
-        hand_input++;
-        request_queue.push(next_io_op_input);
+        delete simulator;
+        delete inputs[d];
+        delete schedulers[d];
     }
-
-    bool hasRequest() {
-        return !(request_queue.empty());
+    printf("SUM: %lld %lld %.2lf %.2lf %lld\n", (long long) clock, tot_movement,
+           tot_turnaround / io_ops.size(), tot_wait_time / io_ops.size(), (long long) max_wait_time);
+    bool has_streams = !io_ops.stream.empty();
+    if (has_streams) {
+        print_stream_summaries(stdout, streams);
+    }
+    if (percentiles) {
+        wait_histogram.print_percentiles(stdout, "wait");
+        turnaround_histogram.print_percentiles(stdout, "turnaround");
+        seek_histogram.print_percentiles(stdout, "seek");
+        if (has_streams) {
+            print_stream_wait_percentiles(stdout, streams);
+        }
     }
+    return 0;
+}
 
 
-};
 
+//-------------------- STEP 9 : Replay the dispatch order on a real file or block device --------------------
+// The replay mode (-r flag) simulates the trace as usual, recording the order in which strategy() issued the IO
+// operations, then reads the track of each IO operation from a file or a block device in this same order, with up to
+// <depth> reads in flight. Track t is the block of <track_size> bytes at offset t * <track_size>.
+// The reads go through io_uring, with the raw system calls (no liburing needed). When io_uring is not available
+// (old kernel, seccomp filter) or with the -P flag, <depth> threads issue them with pread instead.
+// The file is opened with O_DIRECT when the file system allows it, so the page cache doesn't hide the device.
 
-class SSTF: public Scheduler {
-    vector<IO_op*> request_queue;
+struct ReplayConfig {
+    string path;
+    int depth;
+    int track_size;
+    bool force_pread;
 
-    IO_op* strategy() {
-        if (request_queue.empty()) {
-                return NULL;
-        } else {
+    ReplayConfig() {
+        depth = 1;
+        track_size = 4096;
+        force_pread = false;
+    }
+};
 
-            //IO_op* next_io_op = request_queue.front();
-            IO_op* next_io_op = NULL;
-            //int shortest_distance = abs(next_io_op->track - head);
-            int shortest_distance = -1;
-            //vector<IO_op*>::iterator shortest_it_op = request_queue.begin(); // To erase from the queue later
-            vector<IO_op*>::iterator shortest_it_op; // To erase from the queue later
-
-            for (vector<IO_op*>::iterator it_op = request_queue.begin(); it_op != request_queue.end(); it_op++) {
-                IO_op* io_op = *it_op;
-                int distance = abs(io_op->track - head);
-                if ( (next_io_op == NULL) || (distance < shortest_distance) ) {
-                    next_io_op = io_op;
-                    shortest_distance = distance;
-                    shortest_it_op = it_op;
-                }
-            }
-            // At the end of the search, we found the shortest seek time request.
-            // We remove it from the request queue and return it
-            request_queue.erase(shortest_it_op);
-            curr_io_op = next_io_op;
-            return next_io_op;
+// <file>[,<depth>[,<track_size>]]
+bool parse_replay(const char* spec, ReplayConfig& config) {
+    const char* comma = strchr(spec, ',');
+    config.path = (comma != NULL) ? string(spec, comma - spec) : string(spec);
+    if (comma != NULL && sscanf(comma + 1, "%d,%d", &config.depth, &config.track_size) < 1) {
+        return false;
+    }
+    return !config.path.empty() && config.depth >= 1 && config.track_size >= 1;
+}
+
+int64_t monotonic_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Buffer of one read. Aligned on 4096 bytes for O_DIRECT
+char* new_replay_buffer(int track_size) {
+    void* buffer = NULL;
+    if (posix_memalign(&buffer, 4096, track_size) != 0) {
+        return NULL;
+    }
+    return (char*) buffer;
+}
 
+// The io_uring rings, mapped from the kernel
+class Uring {
+    public:
+        int fd;
+        unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+        unsigned *cq_head, *cq_tail, *cq_mask;
+        struct io_uring_sqe* sqes;
+        struct io_uring_cqe* cqes;
+        void* sq_ring;
+        void* cq_ring;
+        size_t sq_ring_size, cq_ring_size, sqes_size;
+
+        Uring() {
+            fd = -1;
+            sq_ring = cq_ring = sqes = NULL;
         }
-    }
 
-    // Move head toward a target track
-    void move_head() {
-        // Careful of edge case : if head is already on the track of a new operation, we don't move it
-        if ( head < curr_io_op->track ) {
-            head++;
-        } else if ( head > curr_io_op->track ) {
-            head--;
+        // False if io_uring is not available
+        bool setup(unsigned entries) {
+            struct io_uring_params params;
+            memset(&params, 0, sizeof(params));
+            fd = syscall(__NR_io_uring_setup, entries, &params);
+            if (fd < 0) {
+                return false;
+            }
+            sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+            if (params.features & IORING_FEAT_SINGLE_MMAP) {
+                sq_ring_size = cq_ring_size = max(sq_ring_size, cq_ring_size);
+            }
+            sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+            if (sq_ring == MAP_FAILED) {
+                sq_ring = NULL;
+                return false;
+            }
+            if (params.features & IORING_FEAT_SINGLE_MMAP) {
+                cq_ring = sq_ring;
+            } else {
+                cq_ring = mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+                if (cq_ring == MAP_FAILED) {
+                    cq_ring = NULL;
+                    return false;
+                }
+            }
+            sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+            void* mapped = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+            if (mapped == MAP_FAILED) {
+                return false;
+            }
+            sqes = (struct io_uring_sqe*) mapped;
+
+            char* sq = (char*) sq_ring;
+            sq_head = (unsigned*) (sq + params.sq_off.head);
+            sq_tail = (unsigned*) (sq + params.sq_off.tail);
+            sq_mask = (unsigned*) (sq + params.sq_off.ring_mask);
+            sq_array = (unsigned*) (sq + params.sq_off.array);
+            char* cq = (char*) cq_ring;
+            cq_head = (unsigned*) (cq + params.cq_off.head);
+            cq_tail = (unsigned*) (cq + params.cq_off.tail);
+            cq_mask = (unsigned*) (cq + params.cq_off.ring_mask);
+            cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+            return true;
         }
 
-        if (head == curr_io_op->track) {
-            curr_io_op->isCompleted = true;
+        ~Uring() {
+            if (sqes != NULL) {
+                munmap(sqes, sqes_size);
+            }
+            if (cq_ring != NULL && cq_ring != sq_ring) {
+                munmap(cq_ring, cq_ring_size);
+            }
+            if (sq_ring != NULL) {
+                munmap(sq_ring, sq_ring_size);
+            }
+            if (fd >= 0) {
+                close(fd);
+            }
         }
-    };
+};
 
-    void add_request() {
-        IO_op* next_io_op_input = IO_ops_input_queue[hand_input];
-        hand_input++;
-        request_queue.push_back(next_io_op_input);
+// Replay with io_uring. latency[io_op] gets the time from the submission to the completion of each read
+// False if io_uring can't be set up : nothing was read then
+bool replay_uring(int fd, const ReplayConfig& config, const IO_pool& io_ops, const vector<op_index>& order,
+                  vector<int64_t>& latency, int* nb_errors) {
+    Uring ring;
+    if ( !ring.setup(config.depth) ) {
+        return false;
     }
 
-    bool hasRequest() {
-        return !(request_queue.empty());
+    // One buffer per read in flight. The user_data of a read is its position in order and its buffer
+    vector<char*> buffers(config.depth);
+    vector<struct iovec> iovecs(config.depth);
+    vector<int> free_buffers;
+    for (int b = 0; b < config.depth; b++) {
+        buffers[b] = new_replay_buffer(config.track_size);
+        iovecs[b].iov_base = buffers[b];
+        iovecs[b].iov_len = config.track_size;
+        free_buffers.push_back(b);
     }
 
-
-};
-
-
-class LOOK: public Scheduler {
-    vector<IO_op*> request_queue;
-    bool going_forward; // This bool decides if we're going forward or backward (direction of the look)
-
-    public :
-        LOOK():Scheduler() {
-            going_forward = true; // We assume that we start with the head at 0 so we move forward
+    size_t next = 0, done = 0;
+    unsigned unsubmitted = 0;
+    while (done < order.size()) {
+        // Fill the submission ring up to the queue depth, in the order of the scheduler
+        while (!free_buffers.empty() && next < order.size()) {
+            int b = free_buffers.back();
+            free_buffers.pop_back();
+            op_index io_op = order[next];
+            unsigned tail = *ring.sq_tail;
+            unsigned index = tail & *ring.sq_mask;
+            struct io_uring_sqe* sqe = &ring.sqes[index];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_READV;
+            sqe->fd = fd;
+            sqe->off = (uint64_t) io_ops.track[io_op] * config.track_size;
+            sqe->addr = (uint64_t) (uintptr_t) &iovecs[b];
+            sqe->len = 1;
+            sqe->user_data = ((uint64_t) next << 32) | (uint64_t) b;
+            ring.sq_array[index] = index;
+            __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+            latency[io_op] = monotonic_ns();
+            next++;
+            unsubmitted++;
         }
 
-    // We must pick the closest request in our direction
-    // It's just like SSTF except we filter out the request which are not in our direction
-    IO_op* strategy() {
-        if (request_queue.empty()) {
-                return NULL;
-        } else {
-
-            IO_op* next_io_op = NULL;
-            int shortest_distance = -1;
-            vector<IO_op*>::iterator shortest_it_op; // To erase from the queue later
-
-            for (vector<IO_op*>::iterator it_op = request_queue.begin(); it_op != request_queue.end(); it_op++) {
-                IO_op* io_op = *it_op;
-                int distance = io_op->track - head;
-                // the conditions check if we are going in the scheduler's direction
-                if ( ( (distance >= 0) && (going_forward) ) 
-                    || ( (distance <= 0) && !going_forward ) ) {
-
-                    if ( (next_io_op == NULL) || (abs(distance) < abs(shortest_distance)) ) {
-                        next_io_op = io_op;
-                        shortest_distance = distance;
-                        shortest_it_op = it_op;
-                    }
+        // Submit and wait for at least one completion
+        int submitted = syscall(__NR_io_uring_enter, ring.fd, unsubmitted, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (submitted < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("io_uring_enter");
+            *nb_errors += order.size() - done;
+            break;
+        }
+        unsubmitted -= submitted;
+
+        unsigned head = *ring.cq_head;
+        while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe* cqe = &ring.cqes[head & *ring.cq_mask];
+            op_index io_op = order[cqe->user_data >> 32];
+            latency[io_op] = monotonic_ns() - latency[io_op];
+            if (cqe->res < 0) {
+                (*nb_errors)++;
+            }
+            free_buffers.push_back((int) (cqe->user_data & 0xffffffff));
+            done++;
+            head++;
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
 
+    for (int b = 0; b < config.depth; b++) {
+        free(buffers[b]);
+    }
+    return true;
+}
+
+// Replay with pread on depth threads, each taking the next IO operation in the order of the scheduler
+void replay_pread(int fd, const ReplayConfig& config, const IO_pool& io_ops, const vector<op_index>& order,
+                  vector<int64_t>& latency, int* nb_errors) {
+    atomic<size_t> next(0);
+    atomic<int> errors(0);
+    vector<thread> threads;
+    for (int t = 0; t < config.depth; t++) {
+        threads.push_back(thread([&]() {
+            char* buffer = new_replay_buffer(config.track_size);
+            for (size_t pos = next++; pos < order.size(); pos = next++) {
+                op_index io_op = order[pos];
+                int64_t start = monotonic_ns();
+                if (pread(fd, buffer, config.track_size, (off_t) io_ops.track[io_op] * config.track_size) < 0) {
+                    errors++;
                 }
+                latency[io_op] = monotonic_ns() - start;
             }
-            // We either found a request or we didn't. For the latter, we have to reverse the direction and do the same
-            if (next_io_op == NULL) {
-                going_forward = !going_forward;
-                for (vector<IO_op*>::iterator it_op = request_queue.begin(); it_op != request_queue.end(); it_op++) {
-                    IO_op* io_op = *it_op;
-                    int distance = io_op->track - head;
-                    // the conditions check if we are going in the scheduler's direction
-                    if ( ( (distance >= 0) && (going_forward) ) 
-                        || ( (distance <= 0) && !going_forward ) ) {
-
-                        if ( (next_io_op == NULL) || (abs(distance) < abs(shortest_distance)) ) {
-                            next_io_op = io_op;
-                            shortest_distance = distance;
-                            shortest_it_op = it_op;
-                        }
+            free(buffer);
+        }));
+    }
+    for (size_t t = 0; t < threads.size(); t++) {
+        threads[t].join();
+    }
+    *nb_errors += errors;
+}
+
+struct ReplayStats {
+    const char* engine; // io_uring or pread
+    bool direct; // if the file was opened with O_DIRECT
+    int nb_errors; // reads that failed
+    double seconds; // time of the whole replay
+    Histogram latency_histogram;
+    double tot_latency;
+};
 
-                    }
-                }
-            } 
+// Read the IO operations of order from the file of config. latency gets the latency in ns of each IO operation
+bool replay(const ReplayConfig& config, const IO_pool& io_ops, const vector<op_index>& order, vector<int64_t>& latency,
+            ReplayStats& stats) {
+    stats.direct = true;
+    int fd = open(config.path.c_str(), O_RDONLY | O_DIRECT);
+    if (fd < 0 && errno == EINVAL) {
+        stats.direct = false;
+        fd = open(config.path.c_str(), O_RDONLY);
+    }
+    if (fd < 0) {
+        perror(config.path.c_str());
+        return false;
+    }
+    struct stat st;
+    io_track max_track = 0;
+    for (size_t pos = 0; pos < order.size(); pos++) {
+        max_track = max(max_track, io_ops.track[order[pos]]);
+    }
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size < ((off_t) max_track + 1) * config.track_size) {
+        fprintf(stderr, "%s: only %lld bytes, the last tracks read past the end of the file\n",
+                config.path.c_str(), (long long) st.st_size);
+    }
 
-            // At the end of the search, we found the shortest seek time request in the scheduler request.
-            // We remove it from the request queue and return it
-            request_queue.erase(shortest_it_op);
-            curr_io_op = next_io_op;
-            return next_io_op;
+    latency.assign(io_ops.size(), 0);
+    stats.nb_errors = 0;
+    stats.engine = "io_uring";
+    int64_t start = monotonic_ns();
+    if (config.force_pread || !replay_uring(fd, config, io_ops, order, latency, &stats.nb_errors)) {
+        stats.engine = "pread";
+        replay_pread(fd, config, io_ops, order, latency, &stats.nb_errors);
+    }
+    stats.seconds = (monotonic_ns() - start) / 1e9;
+    close(fd);
 
+    stats.tot_latency = 0;
+    for (size_t pos = 0; pos < order.size(); pos++) {
+        stats.latency_histogram.record(latency[order[pos]]);
+        stats.tot_latency += latency[order[pos]];
+    }
+    return true;
+}
+
+// REPLAY line after the SUM line : engine, queue depth, track size, O_DIRECT, failed reads, time, IOPS,
+// then the average and p99 latency in microseconds
+void print_replay(const ReplayConfig& config, ReplayStats& stats, size_t nb_io_ops) {
+    printf("REPLAY: %s %d %d %d %d %.3lf %.0lf %.1lf %.1lf\n", stats.engine, config.depth, config.track_size,
+           stats.direct ? 1 : 0, stats.nb_errors, stats.seconds, (stats.seconds > 0) ? nb_io_ops / stats.seconds : 0.0,
+           stats.tot_latency / max(nb_io_ops, (size_t) 1) / 1000.0, stats.latency_histogram.percentile(99) / 1000.0);
+}
+
+
+
+//-------------------- STEP 10 : What-if forks of a snapshot --------------------
+// The fork mode (-T and -F flags) runs the scheduler of -s until the time given by -T, then resumes the snapshot
+// once per scheduler of -F, on -j threads : the warmup is simulated once, and only the rest of the trace is simulated
+// again by each scheduler. The same scheduler as -s goes on exactly like the whole run would.
+// Each fork prints its SUM[<algo>] line, and its PCT lines with -p.
+
+// <time>, or @<oid> for the arrival time of this IO operation. -1 if malformed or out of the trace
+io_time parse_snapshot_time(const char* spec, const IO_pool& io_ops) {
+    long long value;
+    if (spec[0] == '@') {
+        if (sscanf(spec + 1, "%lld", &value) != 1 || value < 0 || (unsigned long long) value >= io_ops.size()) {
+            return -1;
         }
+        return io_ops.arrival_time[value];
     }
-
-    // Move head toward a target track
-    void move_head() {
-        // Careful of edge case : if head is already on the track of a new operation, we don't move it
-        if ( head < curr_io_op->track ) {
-            head++;
-        } else if ( head > curr_io_op->track ) {
-            head--;
+    if (sscanf(spec, "%lld", &value) != 1 || value < 1 || value > MAX_TIME) {
+        return -1;
+    }
+    return value;
+}
+
+int fork_snapshot(const Snapshot& snapshot, const IO_pool& io_ops, const char* algos, char backend,
+                  const SchedulerConfig& config, bool event_driven, int nb_threads, bool percentiles) {
+    int nb_forks = strlen(algos);
+    vector<Simulator*> simulators(nb_forks, (Simulator*) NULL);
+    vector<Scheduler*> schedulers(nb_forks, (Scheduler*) NULL);
+    vector<VectorInput*> inputs(nb_forks, (VectorInput*) NULL);
+    for (int f = 0; f < nb_forks; f++) {
+        schedulers[f] = new_scheduler(algos[f], &io_ops, backend, config);
+        if (schedulers[f] == NULL) {
+            printf("Please give schedulers with -F among i, j, s, c, f, d, a and w\n");
+            return -1;
         }
-
-        if (head == curr_io_op->track) {
-            curr_io_op->isCompleted = true;
+        inputs[f] = new VectorInput(&io_ops);
+        simulators[f] = new Simulator(schedulers[f], &io_ops, inputs[f], false);
+        simulators[f]->cost_model = config.cost_model;
+        restore_snapshot(*simulators[f], algos[f], snapshot);
+    }
+    parallel_for(nb_forks, nb_threads, [&](int f) {
+        run_simulation(*simulators[f], event_driven);
+    });
+
+    int result = 0;
+    for (int f = 0; f < nb_forks; f++) {
+        string name = string("[") + algos[f] + "]";
+        if ( !check_end_times(*simulators[f]) ) {
+            result = -1;
+        } else {
+            simulators[f]->print_sum(("SUM" + name).c_str());
+            if (percentiles) {
+                simulators[f]->wait_histogram.print_percentiles(stdout, ("wait" + name).c_str());
+                simulators[f]->turnaround_histogram.print_percentiles(stdout, ("turnaround" + name).c_str());
+                simulators[f]->seek_histogram.print_percentiles(stdout, ("seek" + name).c_str());
+            }
         }
-    };
-
-    void add_request() {
-        IO_op* next_io_op_input = IO_ops_input_queue[hand_input];
-        hand_input++;
-        request_queue.push_back(next_io_op_input);
+        delete simulators[f];
+        delete inputs[f];
+        delete schedulers[f];
     }
+    return result;
+}
+
+// SNAPSHOT line : time, IO operations arrived, completed, pending in the queues, and the oid in flight (-1 if none)
+void print_snapshot(const Snapshot& snapshot, const IO_pool& io_ops) {
+    printf("SNAPSHOT: %lld %u %d %d %d\n", (long long) snapshot.CLOCK, snapshot.hand_input, snapshot.nb_io_ops,
+           (int) (snapshot.queues[0].size() + snapshot.queues[1].size()),
+           (snapshot.curr_io_op != NO_OP) ? io_ops.oid[snapshot.curr_io_op] : -1);
+}
+
+
+
+//-------------------- STEP 11 : Multi-queue submission from many producer threads --------------------
+// The multi-queue mode (-Q flag) models the submission path of blk-mq. The trace is split round-robin between
+// <producers> threads, each one replaying its own part of the trace as fast as it can. Producer p submits into the
+// hardware queue p % <hwqueues> : a bounded lock-free ring of <depth> requests, single-producer when there are as many
+// hardware queues as producers and multi-producer otherwise. A producer waits when its hardware queue is full.
+// The dispatcher (the main thread) drains the hardware queues into the scheduler, through the IO_input of the simulator.
+// With the fixed merge order (-Of, the default) the dispatcher only hands a request to the simulator once no producer
+// can submit an earlier one, so the results are exactly those of the single-threaded simulation. With the drain
+// order (-Od) the requests reach the scheduler in the order they are drained, and a request drained late arrives when
+// the dispatcher hands it over : the results then depend on the scheduling of the threads.
+// The submission throughput and the contention counters are printed on the standard error.
+
+struct Submission {
+    int oid; // -1 : the producer has no more requests
+    io_time arrival_time;
+    io_track track;
+    int stream; // -1 : the trace has no streams
+    int producer;
+};
 
-    bool hasRequest() {
-        return !(request_queue.empty());
-    }
+// Bounded multi-producer single-consumer ring (Vyukov). Each cell has a sequence number telling if it is free for the
+// producers or ready for the consumer, so a push is one compare-and-swap on the tail, and a pop takes no lock at all
+class SubmissionQueue {
+    struct Cell {
+        atomic<size_t> sequence;
+        Submission submission;
+    };
 
+    Cell* cells;
+    size_t mask;
+    char pad0[64];
+    atomic<size_t> enqueue_pos; // shared by the producers
+    char pad1[64];
+    size_t dequeue_pos; // only used by the dispatcher
+    char pad2[64];
 
-};
+    public:
+        SubmissionQueue(size_t depth) {
+            size_t capacity = 2;
+            while (capacity < depth) {
+                capacity *= 2;
+            }
+            cells = new Cell[capacity];
+            for (size_t i = 0; i < capacity; i++) {
+                cells[i].sequence.store(i, memory_order_relaxed);
+            }
+            mask = capacity - 1;
+            enqueue_pos.store(0, memory_order_relaxed);
+            dequeue_pos = 0;
+        }
 
+        ~SubmissionQueue() {
+            delete[] cells;
+        }
 
-class CLOOK: public Scheduler {
-    // Same as LOOK, we just make minor changes in the strategy
-    vector<IO_op*> request_queue;
+        // False if the queue is full. nb_retries counts the compare-and-swap lost to another producer
+        bool try_push(const Submission& submission, uint64_t* nb_retries) {
+            size_t pos = enqueue_pos.load(memory_order_relaxed);
+            while (true) {
+                Cell& cell = cells[pos & mask];
+                intptr_t diff = (intptr_t) cell.sequence.load(memory_order_acquire) - (intptr_t) pos;
+                if (diff == 0) {
+                    if (enqueue_pos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                        cell.submission = submission;
+                        cell.sequence.store(pos + 1, memory_order_release);
+                        return true;
+                    }
+                    (*nb_retries)++;
+                } else if (diff < 0) {
+                    return false;
+                } else {
+                    pos = enqueue_pos.load(memory_order_relaxed);
+                }
+            }
+        }
 
+        // False if the queue is empty
+        bool try_pop(Submission& submission) {
+            Cell& cell = cells[dequeue_pos & mask];
+            if ((intptr_t) cell.sequence.load(memory_order_acquire) - (intptr_t) (dequeue_pos + 1) < 0) {
+                return false;
+            }
+            submission = cell.submission;
+            cell.sequence.store(dequeue_pos + mask + 1, memory_order_release);
+            dequeue_pos++;
+            return true;
+        }
+};
 
-    // We must pick the closest request in our direction
-    // It's just like SSTF except we filter out the request which are not in our direction
-    IO_op* strategy() {
-        if (request_queue.empty()) {
-                return NULL;
-        } else {
 
-            IO_op* next_io_op = NULL;
-            int shortest_distance = -1;
-            vector<IO_op*>::iterator shortest_it_op; // To erase from the queue later
+// Input of the simulator fed by the dispatcher. The IO operations are allocated in the pool as they are handed to
+// the simulator and released once printed, like in the streaming mode
+class MultiQueueInput: public IO_input {
+    vector<SubmissionQueue*>& hw_queues;
+    IO_pool* io_ops;
+    bool fixed_order;
+    op_index lookahead;
 
-            for (vector<IO_op*>::iterator it_op = request_queue.begin(); it_op != request_queue.end(); it_op++) {
-                IO_op* io_op = *it_op;
-                int distance = io_op->track - head;
-                // the conditions check if we are going in the scheduler's direction which is  always forward
-                if ( distance >= 0 ) {
+    // Requests drained but not handed to the simulator yet
+    typedef pair<pair<io_time, int>, pair<io_track, int> > Pending; // ((arrival, oid), (track, stream))
+    priority_queue< Pending, vector<Pending>, greater<Pending> > by_arrival;
+    deque<Submission> drained;
 
-                    if ( (next_io_op == NULL) || (abs(distance) < abs(shortest_distance)) ) {
-                        next_io_op = io_op;
-                        shortest_distance = distance;
-                        shortest_it_op = it_op;
-                    }
+    // Last (arrival, oid) submitted by each producer : it will never submit an earlier one
+    vector< pair<io_time, int> > watermark;
+    vector<bool> finished;
+    int nb_finished;
+    io_time last_arrival_time;
 
-                }
-            }
-            // We either found a request or we didn't. For the latter, we have to circle back to track 0 and look again
-            // To do so, we copy the previous loop and we change the head to 0
-            // We can't type head = 0 because it is logically false, the scheduler's head doesn't teleport to 0 like that
-            if (next_io_op == NULL) {
-                for (vector<IO_op*>::iterator it_op = request_queue.begin(); it_op != request_queue.end(); it_op++) {
-                    IO_op* io_op = *it_op;
-                    int distance = io_op->track - 0; // <== Here we change
-                    // the conditions check if we are going in the scheduler's direction
-                    // It's useless here since we look from track 0, but who cares
-                    if ( distance >= 0 ) {
-
-                        if ( (next_io_op == NULL) || (abs(distance) < abs(shortest_distance)) ) {
-                            next_io_op = io_op;
-                            shortest_distance = distance;
-                            shortest_it_op = it_op;
-                        }
+    public:
+        uint64_t nb_empty_polls; // times the dispatcher found all the hardware queues empty and had to wait
+        const io_time* clock; // CLOCK of the simulator : in the drain order, a request can't arrive in the past
+
+        MultiQueueInput(vector<SubmissionQueue*>& hw_queues_, IO_pool* io_ops_, int nb_producers, bool fixed_order_)
+            : hw_queues(hw_queues_) {
+            io_ops = io_ops_;
+            fixed_order = fixed_order_;
+            lookahead = NO_OP;
+            watermark.assign(nb_producers, make_pair((io_time) -1, -1));
+            finished.assign(nb_producers, false);
+            nb_finished = 0;
+            last_arrival_time = 0;
+            nb_empty_polls = 0;
+            clock = NULL;
+        }
 
+        // Pop everything available in the hardware queues. False if they were all empty
+        bool drain() {
+            bool found = false;
+            Submission submission;
+            for (size_t q = 0; q < hw_queues.size(); q++) {
+                while (hw_queues[q]->try_pop(submission)) {
+                    found = true;
+                    if (submission.oid < 0) {
+                        finished[submission.producer] = true;
+                        nb_finished++;
+                        continue;
+                    }
+                    watermark[submission.producer] = make_pair(submission.arrival_time, submission.oid);
+                    if (fixed_order) {
+                        by_arrival.push(make_pair(make_pair(submission.arrival_time, submission.oid),
+                                                  make_pair(submission.track, submission.stream)));
+                    } else {
+                        drained.push_back(submission);
                     }
                 }
+            }
+            return found;
+        }
 
-            } 
+        // The slot of lookahead may be reused : its stream is always overwritten when the trace has streams
+        void set_stream(int stream) {
+            if (stream >= 0) {
+                io_ops->set_stream(lookahead, stream);
+            }
+        }
 
-            // At the end of the search, we found the shortest seek time request in the scheduler request.
-            // We remove it from the request queue and return it
-            request_queue.erase(shortest_it_op);
-            curr_io_op = next_io_op;
-            return next_io_op;
+        // In the fixed order, the earliest request drained can go once every producer still running submitted a later one
+        bool earliest_is_safe() {
+            if (by_arrival.empty()) {
+                return false;
+            }
+            for (size_t p = 0; p < watermark.size(); p++) {
+                if (!finished[p] && watermark[p] < by_arrival.top().first) {
+                    return false;
+                }
+            }
+            return true;
+        }
 
+        op_index peek() {
+            while (lookahead == NO_OP) {
+                if (fixed_order && earliest_is_safe()) {
+                    Pending earliest = by_arrival.top();
+                    by_arrival.pop();
+                    lookahead = io_ops->alloc(earliest.first.second, earliest.first.first, earliest.second.first);
+                    set_stream(earliest.second.second);
+                } else if (!fixed_order && !drained.empty()) {
+                    Submission& submission = drained.front();
+                    last_arrival_time = max(last_arrival_time, submission.arrival_time);
+                    lookahead = io_ops->alloc(submission.oid, last_arrival_time, submission.track);
+                    set_stream(submission.stream);
+                    drained.pop_front();
+                } else if (nb_finished == (int) finished.size() && by_arrival.empty() && drained.empty()) {
+                    return NO_OP;
+                } else if (!drain()) {
+                    nb_empty_polls++;
+                    this_thread::yield();
+                }
+            }
+            if (!fixed_order && io_ops->arrival_time[lookahead] < *clock) {
+                // Drained while the simulator was already past its arrival time
+                io_ops->arrival_time[lookahead] = last_arrival_time = *clock;
+            }
+            return lookahead;
         }
-    }
 
-    // Move head toward a target track
-    void move_head() {
-        // Careful of edge case : if head is already on the track of a new operation, we don't move it
-        if ( head < curr_io_op->track ) {
-            head++;
-        } else if ( head > curr_io_op->track ) {
-            head--;
+        op_index next() {
+            op_index io_op = peek();
+            lookahead = NO_OP;
+            return io_op;
         }
 
-        if (head == curr_io_op->track) {
-            curr_io_op->isCompleted = true;
+        void release(op_index io_op) {
+            io_ops->release(io_op);
         }
-    };
+};
+
 
-    void add_request() {
-        IO_op* next_io_op_input = IO_ops_input_queue[hand_input];
-        hand_input++;
-        request_queue.push_back(next_io_op_input);
+struct MultiQueueConfig {
+    int nb_producers; // 0 : no multi-queue mode
+    int nb_hw_queues; // producer p submits into the hardware queue p % nb_hw_queues
+    int depth; // capacity of each hardware queue, rounded up to a power of 2
+    bool fixed_order; // hand the requests to the simulator in the order of the trace, whatever the order they are drained
+
+    MultiQueueConfig() {
+        nb_producers = 0;
+        nb_hw_queues = 1;
+        depth = 256;
+        fixed_order = true;
     }
+};
 
-    bool hasRequest() {
-        return !(request_queue.empty());
+// Simulate the trace submitted by the producers. Print the output like a single-threaded simulation
+int multi_queue(const IO_pool& trace, const MultiQueueConfig& config, char algo, char backend,
+                const SchedulerConfig& scheduler_config, bool event_driven, bool percentiles) {
+    vector<SubmissionQueue*> hw_queues;
+    for (int q = 0; q < config.nb_hw_queues; q++) {
+        hw_queues.push_back(new SubmissionQueue(config.depth));
     }
 
+    IO_pool io_ops;
+    MultiQueueInput input(hw_queues, &io_ops, config.nb_producers, config.fixed_order);
+    Scheduler* scheduler = new_scheduler(algo, &io_ops, backend, scheduler_config);
+    if (scheduler == NULL) {
+        printf("Please give a scheduler with -s among i, j, s, c, f, d, a and w\n");
+        return -1;
+    }
+    Simulator simulator = Simulator(scheduler, &io_ops, &input, true);
+    simulator.cost_model = scheduler_config.cost_model;
+    input.clock = &simulator.CLOCK;
+
+    // Producer p replays the IO operations p, p + producers, p + 2 * producers...
+    vector<uint64_t> nb_retries(config.nb_producers, 0), nb_full_waits(config.nb_producers, 0);
+    vector<double> seconds(config.nb_producers, 0);
+    vector<thread> producers;
+    for (int p = 0; p < config.nb_producers; p++) {
+        producers.push_back(thread([&, p]() {
+            SubmissionQueue* hw_queue = hw_queues[p % config.nb_hw_queues];
+            struct timespec start;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            Submission submission;
+            submission.producer = p;
+            for (op_index io_op = p; io_op < trace.size(); io_op += config.nb_producers) {
+                submission.oid = trace.oid[io_op];
+                submission.arrival_time = trace.arrival_time[io_op];
+                submission.track = trace.track[io_op];
+                submission.stream = trace.stream.empty() ? -1 : trace.stream_of(io_op);
+                while ( !hw_queue->try_push(submission, &nb_retries[p]) ) {
+                    nb_full_waits[p]++;
+                    this_thread::yield();
+                }
+            }
+            submission.oid = -1;
+            while ( !hw_queue->try_push(submission, &nb_retries[p]) ) {
+                nb_full_waits[p]++;
+                this_thread::yield();
+            }
+            seconds[p] = elapsed_ns(start) / 1e9;
+        }));
+    }
 
-};
+    run_simulation(simulator, event_driven);
+    if (simulator.overflow_io_op != NO_OP) {
+        // The simulator stopped reading its input : drain the rest of the submissions, so that the producers finish
+        while (input.next() != NO_OP) {
+        }
+    }
+    for (size_t p = 0; p < producers.size(); p++) {
+        producers[p].join();
+    }
+    if ( !check_end_times(simulator) ) {
+        return -1;
+    }
+    simulator.print_summary();
+    bool has_streams = !trace.stream.empty();
+    if (has_streams) {
+        simulator.print_streams();
+    }
+    if (percentiles) {
+        simulator.print_percentiles();
+        if (has_streams) {
+            simulator.print_stream_percentiles();
+        }
+    }
 
+    uint64_t tot_retries = 0, tot_full_waits = 0;
+    double max_seconds = 0;
+    for (int p = 0; p < config.nb_producers; p++) {
+        tot_retries += nb_retries[p];
+        tot_full_waits += nb_full_waits[p];
+        max_seconds = max(max_seconds, seconds[p]);
+    }
+    fprintf(stderr, "multi-queue : %d producers, %d hardware queues of depth %d : %u submissions in %.3lf s (%.0lf /s), "
+            "%llu CAS retries, %llu full waits, %llu empty polls\n", config.nb_producers, config.nb_hw_queues, config.depth,
+            trace.size(), max_seconds, (max_seconds > 0) ? trace.size() / max_seconds : 0.0,
+            (unsigned long long) tot_retries, (unsigned long long) tot_full_waits, (unsigned long long) input.nb_empty_polls);
+
+    delete scheduler;
+    for (size_t q = 0; q < hw_queues.size(); q++) {
+        delete hw_queues[q];
+    }
+    return 0;
+}
+
+
+
+//-------------------- STEP 12 : Auto-tuner of the scheduler knobs --------------------
+// The tuning mode (-U flag) searches the best scheduler and knobs for a corpus of traces. The search space is a list of
+// variants separated by ';', each a scheduler letter followed by knobs with a list of values separated by ':' :
+//   -U"s,dir=f:b;f,batch=0:8:32;d,expire=100:500:2000,fifo=4:16;j,merge=-1:0:4"
+// Knobs : dir (LOOK and FLOOK : initial direction, f or b), batch (FLOOK : dispatches before a swap, 0 : when empty),
+// expire and fifo (DEADLINE, like -E), budget (FAIRSHARE, like -K), merge (any scheduler : merge window of -g, -1 : no
+// merging).
+// Every combination of the values is a configuration. Each one is simulated on every trace, and scored on three
+// metrics summed over the traces : tot_movement, average turnaround and p99 wait. A configuration is better than
+// another if it is no worse on the three metrics and better on one. The Pareto front is the set of configurations
+// that no other configuration is better than. The objective (-o<movement>,<turnaround>,<tail> weights, 1,1,1 by
+// default) ranks the front.
+// The configurations are spread over -j threads. The metrics only grow from one trace to the next, so a configuration
+// is pruned as soon as its partial sums are already worse than a configuration of the front.
+
+struct TuneConfig {
+    char algo;
+    SchedulerConfig config;
+    int merge_window;
+    string name; // e.g. "f,batch=8,merge=0"
+    double metrics[3]; // sums over the traces : tot_movement, average turnaround, p99 wait
+};
 
-class FLOOK: public Scheduler {
-    // Create POINTERS to add_queue and active_queue
-    vector<IO_op*>* add_queue;
-    vector<IO_op*>* active_queue;
-    bool going_forward; // This bool decides if we're going forward or backward (direction of the look)
+enum { TUNE_MOVEMENT, TUNE_TURNAROUND, TUNE_TAIL, TUNE_NB_METRICS };
 
-    public :
-        FLOOK():Scheduler() {
-            going_forward = true; // We assume that we start with the head at 0 so we move forward
-            add_queue = new vector<IO_op*>();
-            active_queue = new vector<IO_op*>();
+// True if a is no worse than b on every metric and better on one
+bool dominates(const double* a, const double* b) {
+    bool better = false;
+    for (int m = 0; m < TUNE_NB_METRICS; m++) {
+        if (a[m] > b[m]) {
+            return false;
         }
-    // It's just like LOOK, just need to swap the queue when the active_queue is empty..
-    IO_op* strategy() {
-        if (add_queue->empty() && active_queue->empty()) {
-                return NULL;
-        } else {
-            
-            // First we check if active queue is empty or not. If empty, we swap
-            if (active_queue->empty()) {
-                swap(active_queue, add_queue);
-            }
-
-            // Now we know for sure that the active queue is NOT empty
-            // If it is still empty, it means that the add_queue was also empty
-            // But if that was the case, we would have returned NULL previously
-
-            // Now we do just like LOOK but with the active_queue. It's the same code literally
-            IO_op* next_io_op = NULL;
-            int shortest_distance = -1;
-            vector<IO_op*>::iterator shortest_it_op; // To erase from the queue later
-
-            for (vector<IO_op*>::iterator it_op = active_queue->begin(); it_op != active_queue->end(); it_op++) {
-                IO_op* io_op = *it_op;
-                int distance = io_op->track - head;
-                // the conditions check if we are going in the scheduler's direction
-                if ( ( (distance >= 0) && (going_forward) ) 
-                    || ( (distance <= 0) && !going_forward ) ) {
-
-                    if ( (next_io_op == NULL) || (abs(distance) < abs(shortest_distance)) ) {
-                        next_io_op = io_op;
-                        shortest_distance = distance;
-                        shortest_it_op = it_op;
-                    }
-
-                }
+        better = better || a[m] < b[m];
+    }
+    return better;
+}
+
+// Set the knob name of config to value. False if the knob or the value is unknown
+bool set_knob(TuneConfig& config, const string& name, const string& value) {
+    if (name == "dir" && (value == "f" || value == "b")) {
+        config.config.look_forward = (value == "f");
+        return strchr("sf", config.algo) != NULL;
+    }
+    char* end;
+    long number = strtol(value.c_str(), &end, 10);
+    if (value.empty() || *end != '\0') {
+        return false;
+    }
+    if (name == "batch" && number >= 0) {
+        config.config.flook_batch = number;
+        return config.algo == 'f';
+    } else if (name == "expire" && number >= 0) {
+        config.config.expire = number;
+        return config.algo == 'd';
+    } else if (name == "fifo" && number >= 1) {
+        config.config.fifo_batch = number;
+        return config.algo == 'd';
+    } else if (name == "budget" && number >= 0) {
+        config.config.fair_budget = number;
+        return config.algo == 'w';
+    } else if (name == "merge" && number >= -1) {
+        config.merge_window = number;
+        return true;
+    }
+    return false;
+}
+
+vector<string> split(const string& text, char separator) {
+    vector<string> parts;
+    stringstream stream(text);
+    string part;
+    while (getline(stream, part, separator)) {
+        parts.push_back(part);
+    }
+    return parts;
+}
+
+// Expand the search space into configurations. False if it is malformed
+bool parse_space(const char* spec, const SchedulerConfig& base, vector<TuneConfig>& configs) {
+    vector<string> variants = split(spec, ';');
+    for (size_t v = 0; v < variants.size(); v++) {
+        vector<string> fields = split(variants[v], ',');
+        if (fields.empty() || fields[0].size() != 1 || strchr("ijscfdaw", fields[0][0]) == NULL) {
+            return false;
+        }
+        TuneConfig first;
+        first.algo = fields[0][0];
+        first.config = base;
+        first.merge_window = -1;
+        first.name = fields[0];
+        vector<TuneConfig> expanded(1, first);
+        for (size_t f = 1; f < fields.size(); f++) {
+            size_t equal = fields[f].find('=');
+            if (equal == string::npos) {
+                return false;
             }
-            // We either found a request or we didn't. For the latter, we have to reverse the direction and do the same as before
-            if (next_io_op == NULL) {
-                going_forward = !going_forward; // Here we make a change
-                for (vector<IO_op*>::iterator it_op = active_queue->begin(); it_op != active_queue->end(); it_op++) {
-                    IO_op* io_op = *it_op;
-                    int distance = io_op->track - head;
-                    // the conditions check if we are going in the scheduler's direction
-                    if ( ( (distance >= 0) && (going_forward) ) 
-                        || ( (distance <= 0) && !going_forward ) ) {
-
-                        if ( (next_io_op == NULL) || (abs(distance) < abs(shortest_distance)) ) {
-                            next_io_op = io_op;
-                            shortest_distance = distance;
-                            shortest_it_op = it_op;
-                        }
-
+            string name = fields[f].substr(0, equal);
+            vector<string> values = split(fields[f].substr(equal + 1), ':');
+            if (values.empty()) {
+                return false;
+            }
+            vector<TuneConfig> product;
+            for (size_t c = 0; c < expanded.size(); c++) {
+                for (size_t i = 0; i < values.size(); i++) {
+                    TuneConfig config = expanded[c];
+                    if ( !set_knob(config, name, values[i]) ) {
+                        return false;
                     }
+                    config.name += "," + name + "=" + values[i];
+                    product.push_back(config);
                 }
-            } 
-
-            // At the end of the search, we found the shortest seek time request in the scheduler request.
-            // We remove it from the request queue and return it
-            active_queue->erase(shortest_it_op);
-            curr_io_op = next_io_op;
-            return next_io_op;
+            }
+            expanded.swap(product);
+        }
+        configs.insert(configs.end(), expanded.begin(), expanded.end());
+    }
+    return !configs.empty();
+}
+
+int tune(char** traces, int nb_traces, const char* space, const double* weights, int nb_threads,
+         char backend, const SchedulerConfig& base, bool binary, bool mmapped) {
+    vector<TuneConfig> configs;
+    if ( !parse_space(space, base, configs) ) {
+        fprintf(stderr, "Option -U requires <algo>[,<knob>=<value>[:<value>...]...][;...] with the knobs dir, batch, "
+                "expire, fifo, budget and merge.\n");
+        return -1;
+    }
 
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    vector<IO_pool> io_ops(nb_traces);
+    vector<char> loaded(nb_traces);
+    parallel_for(nb_traces, nb_threads, [&](int t) {
+        loaded[t] = load_trace(traces[t], io_ops[t], binary, mmapped);
+    });
+    for (int t = 0; t < nb_traces; t++) {
+        if ( !loaded[t] ) {
+            fprintf(stderr, "Could not load %s\n", traces[t]);
+            return -1;
         }
     }
 
-    // Move head toward a target track
-    void move_head() {
-        // Careful of edge case : if head is already on the track of a new operation, we don't move it
-        if ( head < curr_io_op->track ) {
-            head++;
-        } else if ( head > curr_io_op->track ) {
-            head--;
+    // The front only holds fully evaluated configurations, as indexes in configs
+    mutex front_lock;
+    vector<int> front;
+    atomic<int> nb_pruned(0), nb_simulations(0), nb_overflows(0);
+
+    parallel_for(configs.size(), nb_threads, [&](int c) {
+        TuneConfig& config = configs[c];
+        for (int m = 0; m < TUNE_NB_METRICS; m++) {
+            config.metrics[m] = 0;
         }
+        for (int t = 0; t < nb_traces; t++) {
+            Scheduler* scheduler = new_scheduler(config.algo, &io_ops[t], backend, config.config);
+            VectorInput input(&io_ops[t]);
+            Simulator simulator = Simulator(scheduler, &io_ops[t], &input, false);
+            simulator.cost_model = config.config.cost_model;
+            simulator.merge_window = config.merge_window;
+            simulator.event_simulation();
+            config.metrics[TUNE_MOVEMENT] += simulator.tot_movement;
+            config.metrics[TUNE_TURNAROUND] += simulator.avg_turnaround / max(simulator.nb_io_ops, 1);
+            config.metrics[TUNE_TAIL] += simulator.wait_histogram.percentile(99);
+            bool end_times_ok = check_end_times(simulator);
+            delete scheduler;
+            nb_simulations++;
+            if (!end_times_ok) {
+                nb_overflows++;
+                return;
+            }
 
-        if (head == curr_io_op->track) {
-            curr_io_op->isCompleted = true;
+            if (t == nb_traces - 1) {
+                break; // fully evaluated : checked below, in the same lock as the insertion
+            }
+            lock_guard<mutex> guard(front_lock);
+            for (size_t f = 0; f < front.size(); f++) {
+                if (dominates(configs[front[f]].metrics, config.metrics)) {
+                    nb_pruned++;
+                    return;
+                }
+            }
         }
-    };
 
-    void add_request() {
-        IO_op* next_io_op_input = IO_ops_input_queue[hand_input];
-        hand_input++;
-        add_queue->push_back(next_io_op_input);
+        // Not dominated by the front : it joins it, and the configurations it dominates leave it. Both under one
+        // lock, so that of two configurations finishing together, the dominated one never stays in the front
+        lock_guard<mutex> guard(front_lock);
+        for (size_t f = 0; f < front.size(); f++) {
+            if (dominates(configs[front[f]].metrics, config.metrics)) {
+                return;
+            }
+        }
+        vector<int> new_front(1, c);
+        for (size_t f = 0; f < front.size(); f++) {
+            if ( !dominates(config.metrics, configs[front[f]].metrics) ) {
+                new_front.push_back(front[f]);
+            }
+        }
+        front.swap(new_front);
+    });
+    if (nb_overflows > 0) {
+        return -1;
     }
 
-    bool hasRequest() {
-        // If the active queue is empty, we would swap so we need to check the add_queue aswell
-        return !( active_queue->empty() && add_queue->empty() );
+    // Best objective first. The metrics are printed as averages over the traces
+    vector< pair<double, string> > ranked;
+    for (size_t f = 0; f < front.size(); f++) {
+        const TuneConfig& config = configs[front[f]];
+        double objective = 0;
+        for (int m = 0; m < TUNE_NB_METRICS; m++) {
+            objective += weights[m] * config.metrics[m] / nb_traces;
+        }
+        char line[256];
+        snprintf(line, sizeof(line), "%.2lf %.2lf %.2lf %.2lf", config.metrics[TUNE_MOVEMENT] / nb_traces,
+                 config.metrics[TUNE_TURNAROUND] / nb_traces, config.metrics[TUNE_TAIL] / nb_traces, objective);
+        ranked.push_back(make_pair(objective, config.name + " " + line));
     }
-
-
+    sort(ranked.begin(), ranked.end());
+    for (size_t r = 0; r < ranked.size(); r++) {
+        printf("PARETO: %s\n", ranked[r].second.c_str());
+    }
+    if ( !ranked.empty() ) {
+        printf("BEST: %s\n", ranked[0].second.c_str());
+    }
+    fprintf(stderr, "tune : %d configurations on %d traces, %d simulations (%d configurations pruned) on %d threads "
+            "in %.3lf s\n", (int) configs.size(), nb_traces, (int) nb_simulations, (int) nb_pruned, nb_threads,
+            elapsed_ns(start) / 1e9);
+    return 0;
+}
+
+
+
+//-------------------- STEP 13 : Differential validation of the engines against the reference --------------------
+// The validation mode (-V flag) checks that the faster engines give exactly the results of the reference : the
+// per-tick simulation() with the vector scan queue, i.e. the engine of the ouputs/ files. It generates <traces>
+// random traces, simulates each one under every scheduler of -s with the reference and with each engine below, and
+// compares the start and end time of every IO operation and the SUM line, and checks that the seek histogram adds up
+// to the movement of the SUM line. The traces are small and stress the edge cases : several arrivals at the same time,
+// few tracks (many requests on the same track), requests on the track of the head, long idle gaps. Trace i is generated from the seed <seed> + i, so a run can be reproduced on any number
+// of threads (-j).
+// The first divergence of each (scheduler, engine) is shrunk to a minimal trace that still diverges : chunks of IO
+// operations are removed, then the tracks and the gaps between arrivals are made smaller, as long as the divergence
+// remains. The reproducer is printed as a trace, so it can be saved and run with the usual flags.
+// The traces of past divergences and crashes (REGRESSION_TRACES) are checked too, before the random ones.
+
+struct Engine {
+    const char* name;
+    bool event_driven;
+    char backend;
+    bool snapshot; // stopped halfway, saved and resumed in a new simulator
 };
 
+const Engine VALIDATE_ENGINES[] = {
+    {"event,v", true, 'v', false},
+    {"tick,t", false, 't', false},
+    {"event,t", true, 't', false},
+    {"event,s", true, 's', false},
+    {"event,1", true, '1', false},
+    {"tick,h", false, 'h', false},
+    {"event,h", true, 'h', false},
+    {"snapshot,v", true, 'v', true},
+    {"snapshot,t", true, 't', true},
+};
+const int VALIDATE_NB_ENGINES = sizeof(VALIDATE_ENGINES) / sizeof(VALIDATE_ENGINES[0]);
 
+typedef vector< pair<io_time, io_track> > TestTrace; // (arrival time, track) of each IO operation
 
+const vector<TestTrace> REGRESSION_TRACES = {
+#ifndef IOSCHED_LARGE_DISK
+    // A request alone in the queue, INT_MAX tracks from the head : the SIMD kernels took its distance for the key of
+    // the other direction and found no request. Only in the 32-bit build, where this seek stops the simulation right
+    // away (see check_end_time) : with 64-bit times the reference would tick 2^31 times
+    {{1, INT_MAX}, {2, 0}},
+#endif
+};
 
-//-------------------- STEP 5 : Create the simulator --------------------
-
-struct Simulator {
-    int CLOCK; // internal clock
-    IO_op* curr_io_op; // Current IO operation
-
-    int tot_movement; // total total number of tracks the head had to be moved
-    double avg_turnaround; // average turnaround time per operation from time of submission to time of completion
-    double avg_wait_time; // average wait time per operation (time from submission to issue of IO request to start disk operation)
-    int max_wait_time; // maximum wait time for any IO operation.
-    
-    Scheduler* scheduler;
-
-    Simulator(Scheduler* scheduler_) {
-        CLOCK = -1;
-        scheduler = scheduler_;
-        curr_io_op = scheduler->curr_io_op;
+// What a simulation computed : the results of the IO operations and the SUM line
+struct Outcome {
+    bool finished; // false if the simulation was still running at the time limit
+    vector< pair<io_time, io_time> > times; // (start time, end time) of each IO operation
+    io_time clock;
+    int64_t tot_movement;
+    int64_t seek_sum; // sum of the seek histogram : always tot_movement
+    double sum_turnaround;
+    double sum_wait_time;
+    io_time max_wait_time;
+    int overflow_oid; // IO operation ending after MAX_TIME, where the simulation stopped (-1 if none)
+};
 
-        avg_turnaround = 0;
-        avg_wait_time = 0;
-        max_wait_time = 0;
-        tot_movement = 0;
+// Random trace of the edge cases. Each trace draws how likely each case is, so some traces have many of them
+void generate_test_trace(unsigned seed, TestTrace& trace) {
+    mt19937 rng(seed);
+    uniform_real_distribution<double> coin(0, 1);
+    int nb_io_ops = 1 + rng() % ((coin(rng) < 0.9) ? 48 : 300);
+    io_track maxtracks = 1 + rng() % ((coin(rng) < 0.3) ? 4 : 200);
+    double same_time = coin(rng) * 0.5;
+    double same_track = coin(rng) * 0.5;
+    double idle_gap = coin(rng) * 0.2;
+
+    trace.clear();
+    io_time arrival_time = 1 + rng() % 8;
+    io_track last_track = 0; // where the head starts
+    for (int i = 0; i < nb_io_ops; i++) {
+        if (i > 0 && coin(rng) >= same_time) {
+            arrival_time += (coin(rng) < idle_gap) ? 100 + rng() % 5000 : 1 + rng() % 20;
+        }
+        io_track track = (coin(rng) < same_track) ? last_track : rng() % maxtracks;
+        trace.push_back(make_pair(arrival_time, track));
+        last_track = track;
     }
+}
 
-
-    void compute_info(IO_op* io_op) {
-        io_op->end_time = CLOCK;
-        io_op->turnaround_time = CLOCK - io_op->arrival_time;
+void fill_pool(const TestTrace& trace, IO_pool& io_ops) {
+    io_ops.reserve(trace.size());
+    for (size_t i = 0; i < trace.size(); i++) {
+        io_ops.alloc(i, trace[i].first, trace[i].second);
+    }
+}
+
+// Simulate the trace with algo on engine, or with the reference if engine is NULL
+void simulate_test_trace(const IO_pool& io_ops, char algo, const Engine* engine, Outcome& outcome) {
+    // Each IO operation is issued at most once all the previous ones are done, and it takes at most one time unit per
+    // track plus one : a simulation still running after that is stuck
+    io_track max_track = 0;
+    for (op_index io_op = 0; io_op < io_ops.size(); io_op++) {
+        max_track = max(max_track, io_ops.track[io_op]);
+    }
+    int64_t time_limit = io_ops.arrival_time[io_ops.size() - 1] + (int64_t) (io_ops.size() + 1) * (max_track + (int64_t) 2) + 2;
+    time_limit = min(time_limit, (int64_t) MAX_TIME);
+
+    Scheduler* scheduler = new_scheduler(algo, &io_ops, (engine != NULL) ? engine->backend : 'v');
+    VectorInput input(&io_ops);
+    Simulator simulator = Simulator(scheduler, &io_ops, &input, false);
+    Scheduler* resumed_scheduler = NULL;
+    VectorInput resumed_input(&io_ops);
+    Simulator* resumed = NULL;
+    simulator.stop_time = time_limit;
+
+    if (engine != NULL && engine->snapshot) {
+        simulator.stop_time = io_ops.arrival_time[io_ops.size() / 2] + 1;
+        run_simulation(simulator, true);
+        // A simulation stopped on an overflow is done : it is not saved (see -T)
+        if (simulator.overflow_io_op == NO_OP) {
+            Snapshot snapshot;
+            take_snapshot(simulator, algo, snapshot);
+            resumed_scheduler = new_scheduler(algo, &io_ops, engine->backend);
+            resumed = new Simulator(resumed_scheduler, &io_ops, &resumed_input, false);
+            restore_snapshot(*resumed, algo, snapshot);
+            resumed->stop_time = time_limit;
+            run_simulation(*resumed, engine->event_driven);
+        }
+    } else {
+        run_simulation(simulator, engine != NULL && engine->event_driven);
     }
 
+    const Simulator& done = (resumed != NULL) ? *resumed : simulator;
+    outcome.finished = done.CLOCK < time_limit;
+    outcome.times.resize(io_ops.size());
+    for (op_index io_op = 0; io_op < io_ops.size(); io_op++) {
+        outcome.times[io_op] = make_pair(done.results[io_op].start_time, done.results[io_op].end_time);
+    }
+    outcome.clock = done.CLOCK;
+    outcome.tot_movement = done.tot_movement;
+    outcome.seek_sum = done.seek_histogram.sum();
+    if (done.curr_io_op != NO_OP) {
+        // Stopped before the end of the IO operation in flight : its seek isn't in the histogram yet
+        outcome.seek_sum += done.tot_movement - done.seek_start;
+    }
+    outcome.sum_turnaround = done.avg_turnaround;
+    outcome.sum_wait_time = done.avg_wait_time;
+    outcome.max_wait_time = done.max_wait_time;
+    outcome.overflow_oid = (done.overflow_io_op != NO_OP) ? io_ops.oid[done.overflow_io_op] : -1;
+
+    delete resumed;
+    delete resumed_scheduler;
+    delete scheduler;
+}
+
+// Empty if the outcomes are the same, else what differs first
+string compare_outcomes(const Outcome& reference, const Outcome& outcome) {
+    char what[256];
+    if (reference.finished != outcome.finished) {
+        snprintf(what, sizeof(what), "%s", reference.finished ? "the engine is stuck" : "the reference is stuck");
+        return what;
+    }
+    const Outcome* outcomes[2] = {&reference, &outcome};
+    for (int o = 0; o < 2; o++) {
+        if (outcomes[o]->seek_sum != outcomes[o]->tot_movement) {
+            snprintf(what, sizeof(what), "the seeks of the %s add up to %lld tracks instead of the movement %lld",
+                     (o == 0) ? "reference" : "engine", (long long) outcomes[o]->seek_sum,
+                     (long long) outcomes[o]->tot_movement);
+            return what;
+        }
+    }
+    if (reference.overflow_oid != outcome.overflow_oid) {
+        snprintf(what, sizeof(what), "stopped on an overflow at IO operation %d instead of %d", outcome.overflow_oid,
+                 reference.overflow_oid);
+        return what;
+    }
+    for (size_t oid = 0; oid < reference.times.size(); oid++) {
+        if (reference.times[oid] != outcome.times[oid]) {
+            snprintf(what, sizeof(what), "IO operation %d : start %lld end %lld instead of start %lld end %lld",
+                     (int) oid, (long long) outcome.times[oid].first, (long long) outcome.times[oid].second,
+                     (long long) reference.times[oid].first, (long long) reference.times[oid].second);
+            return what;
+        }
+    }
+    if (reference.clock != outcome.clock || reference.tot_movement != outcome.tot_movement
+        || reference.sum_turnaround != outcome.sum_turnaround || reference.sum_wait_time != outcome.sum_wait_time
+        || reference.max_wait_time != outcome.max_wait_time) {
+        snprintf(what, sizeof(what), "SUM : %lld %lld %.0lf %.0lf %lld instead of %lld %lld %.0lf %.0lf %lld",
+                 (long long) outcome.clock, (long long) outcome.tot_movement, outcome.sum_turnaround,
+                 outcome.sum_wait_time, (long long) outcome.max_wait_time, (long long) reference.clock,
+                 (long long) reference.tot_movement, reference.sum_turnaround, reference.sum_wait_time,
+                 (long long) reference.max_wait_time);
+        return what;
+    }
+    if (!reference.finished) {
+        return "the reference is stuck";
+    }
+    return "";
+}
 
-    void simulation() {
-        CLOCK = 1; // Initialize clock
-        while (true) {
-            if (CLOCK == 889) {
-                int caca = 0;
-            }
-            curr_io_op = scheduler->curr_io_op;
-
-            if (hand_input < size_IO_ops_input_queue && IO_ops_input_queue[hand_input]->arrival_time == CLOCK) {
-                scheduler->add_request();
-            }
-            if ( curr_io_op != NULL && curr_io_op->isCompleted ) {
-                compute_info(curr_io_op);
-                scheduler->curr_io_op = NULL;
-                curr_io_op = NULL;
+// Empty if engine gives the results of the reference on trace, else the divergence
+string diverges(const TestTrace& trace, char algo, const Engine* engine) {
+    if (trace.empty()) {
+        return "";
+    }
+    IO_pool io_ops;
+    fill_pool(trace, io_ops);
+    Outcome reference, outcome;
+    simulate_test_trace(io_ops, algo, NULL, reference);
+    simulate_test_trace(io_ops, algo, engine, outcome);
+    return compare_outcomes(reference, outcome);
+}
+
+// Smallest trace we can find that still diverges. The arrival times stay sorted and >= 1
+void shrink(TestTrace& trace, char algo, const Engine* engine) {
+    bool progress = true;
+    while (progress) {
+        progress = false;
+        // Remove chunks of IO operations, from half the trace down to single ones
+        for (size_t chunk = trace.size() / 2; chunk >= 1; chunk /= 2) {
+            for (size_t begin = 0; begin + chunk <= trace.size(); ) {
+                TestTrace smaller(trace.begin(), trace.begin() + begin);
+                smaller.insert(smaller.end(), trace.begin() + begin + chunk, trace.end());
+                if ( !diverges(smaller, algo, engine).empty() ) {
+                    trace.swap(smaller);
+                    progress = true;
+                } else {
+                    begin += chunk;
+                }
             }
-            if (curr_io_op == NULL) {
-                if ( scheduler->hasRequest() ) {
-                    curr_io_op = scheduler->strategy();
-                    curr_io_op->start_time = CLOCK;
-                    curr_io_op->wait_time = CLOCK - curr_io_op->arrival_time;
-                } 
-                else if ( !(scheduler->hasRequest()) && hand_input == size_IO_ops_input_queue ) {
-                    return;
+        }
+        // Smaller tracks : 0, half, minus one
+        for (size_t i = 0; i < trace.size(); i++) {
+            io_track candidates[3] = {0, trace[i].second / 2, trace[i].second - 1};
+            for (int c = 0; c < 3; c++) {
+                if (candidates[c] < 0 || candidates[c] >= trace[i].second) {
+                    continue;
+                }
+                TestTrace smaller = trace;
+                smaller[i].second = candidates[c];
+                if ( !diverges(smaller, algo, engine).empty() ) {
+                    trace.swap(smaller);
+                    progress = true;
+                    break;
                 }
             }
-            if (curr_io_op != NULL) {
-                int temp_past_head = scheduler->head;
-                scheduler->move_head();
-                // Check if head had to be moved
-                if (temp_past_head != scheduler->head) {
-                    tot_movement++;
-                } 
-                // Else, it means the head is already on the new IO operation's track so we choose another
-                // Warning edge case : Because one hand movement = 1 time unit, this must happen within the SAME time unit
-                // So we must skip the "CLOCK++" by using a continue statement
-                else {
+        }
+        // Shorter gaps : all the IO operations from i on arrive earlier
+        for (size_t i = 0; i < trace.size(); i++) {
+            io_time gap = trace[i].first - ((i > 0) ? trace[i - 1].first : 1);
+            io_time candidates[3] = {gap, gap - gap / 2, 1};
+            for (int c = 0; c < 3; c++) {
+                if (candidates[c] <= 0 || candidates[c] > gap) {
                     continue;
                 }
+                TestTrace smaller = trace;
+                for (size_t j = i; j < smaller.size(); j++) {
+                    smaller[j].first -= candidates[c];
+                }
+                if ( !diverges(smaller, algo, engine).empty() ) {
+                    trace.swap(smaller);
+                    progress = true;
+                    break;
+                }
             }
+        }
+    }
+}
+
+int validate(int nb_traces, unsigned seed, const char* algos, int nb_threads) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int nb_algos = strlen(algos);
+    for (int a = 0; a < nb_algos; a++) {
+        if (strchr("ijscfdaw", algos[a]) == NULL) {
+            printf("Please give schedulers with -s among i, j, s, c, f, d, a and w\n");
+            return -1;
+        }
+    }
 
-            CLOCK++;
-
-        } // end of while loop
-    } // end of simulation function
-
-    void print_summary() {
-        for (vector<IO_op*>::iterator op_it = IO_ops_input_queue.begin(); op_it != IO_ops_input_queue.end(); op_it++) {
-            IO_op* io_op = *op_it;
-
-            // Print stat
-            printf("%5d: %5d %5d %5d\n", io_op->oid, io_op->arrival_time, io_op->start_time, io_op->end_time);
-
-            // Compute summary statistic
-            avg_turnaround += (double) io_op->turnaround_time;
-            avg_wait_time += (double) io_op->wait_time;
-            if (io_op->wait_time > max_wait_time) {
-                max_wait_time = io_op->wait_time;
+    mutex report_lock;
+    set<string> reported; // "<algo> <engine>" already shrunk and printed
+    atomic<long long> nb_simulations(0), nb_divergences(0);
+
+    int nb_regressions = REGRESSION_TRACES.size();
+    parallel_for(nb_regressions + nb_traces, nb_threads, [&](int j) {
+        TestTrace trace;
+        char origin[32]; // where the trace comes from, in the DIVERGE lines
+        if (j < nb_regressions) {
+            trace = REGRESSION_TRACES[j];
+            snprintf(origin, sizeof(origin), "regression %d", j);
+        } else {
+            generate_test_trace(seed + j - nb_regressions, trace);
+            snprintf(origin, sizeof(origin), "seed %u", seed + j - nb_regressions);
+        }
+        IO_pool io_ops;
+        fill_pool(trace, io_ops);
+        for (int a = 0; a < nb_algos; a++) {
+            Outcome reference, outcome;
+            simulate_test_trace(io_ops, algos[a], NULL, reference);
+            for (int e = 0; e < VALIDATE_NB_ENGINES; e++) {
+                const Engine* engine = &VALIDATE_ENGINES[e];
+                // FIFO, DEADLINE and SATF don't use the request queue backends
+                if (strchr("ida", algos[a]) != NULL && engine->backend != 'v') {
+                    continue;
+                }
+                simulate_test_trace(io_ops, algos[a], engine, outcome);
+                nb_simulations++;
+                string what = compare_outcomes(reference, outcome);
+                if (what.empty()) {
+                    continue;
+                }
+                nb_divergences++;
+                string key = string(1, algos[a]) + " " + engine->name;
+                {
+                    lock_guard<mutex> guard(report_lock);
+                    if ( !reported.insert(key).second ) {
+                        continue;
+                    }
+                }
+                TestTrace reproducer = trace;
+                shrink(reproducer, algos[a], engine);
+                what = diverges(reproducer, algos[a], engine);
+
+                lock_guard<mutex> guard(report_lock);
+                printf("DIVERGE: -s%c %s %s : %s\n", algos[a], engine->name, origin, what.c_str());
+                printf("#reproducer -s%c %s %s\n", algos[a], engine->name, origin);
+                printf("#numio=%d maxtracks=0 lambda=0\n", (int) reproducer.size());
+                for (size_t i = 0; i < reproducer.size(); i++) {
+                    printf("%lld %lld\n", (long long) reproducer[i].first, (long long) reproducer[i].second);
+                }
+                fflush(stdout);
             }
         }
+    });
 
-        avg_turnaround /= (double) size_IO_ops_input_queue;
-        avg_wait_time /= (double) size_IO_ops_input_queue;
+    printf("VALIDATE: %d %lld %lld\n", nb_traces, (long long) nb_simulations, (long long) nb_divergences);
+    fprintf(stderr, "validate : %d traces and %d regression traces, %lld simulations compared with the reference on %d "
+            "threads in %.3lf s\n", nb_traces, nb_regressions, (long long) nb_simulations, nb_threads,
+            elapsed_ns(start) / 1e9);
+    return (nb_divergences == 0) ? 0 : 1;
+}
 
 
-        printf("SUM: %d %d %.2lf %.2lf %d\n",
-                CLOCK, tot_movement, avg_turnaround, avg_wait_time, max_wait_time);
-    }
 
-}; // End of struct simulator
+// Cost model of the -M flag : l for the linear model (the default), or c for the seek curve with rotation,
+// with optional parameters (see SeekCurveCost). model is left NULL for the linear model
+bool parse_cost_model(const char* spec, const CostModel** model) {
+    if (strcmp(spec, "l") == 0) {
+        *model = NULL;
+        return true;
+    }
+    if (spec[0] != 'c' || (spec[1] != '\0' && spec[1] != ',')) {
+        return false;
+    }
+    double settle = 10, sqrt_coef = 1.5, knee = 1000, linear_coef = 0.02;
+    int rotation = 83, transfer = 1;
+    if (spec[1] == ',' && sscanf(spec + 2, "%lf,%lf,%lf,%lf,%d,%d", &settle, &sqrt_coef, &knee, &linear_coef,
+                                 &rotation, &transfer) < 1) {
+        return false;
+    }
+    if (settle < 0 || sqrt_coef < 0 || knee < 0 || linear_coef < 0 || rotation < 0 || transfer < 0) {
+        return false;
+    }
+    *model = new SeekCurveCost(settle, sqrt_coef, knee, linear_coef, rotation, transfer);
+    return true;
+}
 
 
 
 int main(int argc, char *argv[]) {
-    
+
     bool sflag = false;
     bool vflag = false;
     bool qflag = false;
     bool fflag = false;
+    bool eflag = false; // event-driven simulation instead of the per-tick one
+    bool Sflag = false; // streaming mode : read the input lazily and print the IO operations as they complete
+    bool mflag = false; // load the input with the memory-mapped parser
+    bool Bflag = false; // the input is a binary trace
+    char *Cvalue = NULL; // convert the input trace to this file (text to binary or binary to text) and exit
     char *svalue = NULL;
+    char bvalue = 'v'; // backend of the request queues (v: vector scan, t: tree)
+    char *wvalue = NULL; // sweep mode : output directory
+    int nb_threads = thread::hardware_concurrency(); // number of threads of the sweep mode
+    char *Gvalue = NULL; // write a synthetic workload on the standard output and exit
+    char *xvalue = NULL; // run the benchmark, write the results in this CSV file and exit
+    int nb_devices = 0; // multi-device mode : number of devices (0 : single device)
+    int stripe = 1; // multi-device mode : number of consecutive tracks on the same device
+    char *Dvalue = NULL; // dump the binary trace records to this file instead of printing them
+    bool pflag = false; // print the percentiles of the wait time, turnaround time and seek distance
+    char *Hvalue = NULL; // dump the full histograms to this CSV file
+    char *rvalue = NULL; // replay the dispatch order on this file : <file>[,<depth>[,<track_size>]]
+    bool Pflag = false; // replay with pread even if io_uring is available
+    char *Tvalue = NULL; // stop the simulation at this time (or @<oid>) and take a snapshot
+    char *Fvalue = NULL; // fork the snapshot under each of these schedulers
+    char *Wvalue = NULL; // save the snapshot to this file
+    char *Rvalue = NULL; // resume the simulation from this snapshot file
+    MultiQueueConfig multi_queue_config; // multi-queue mode : -Q<producers>[,<hwqueues>[,<depth>]] and -O<f|d>
+    char *Uvalue = NULL; // tuning mode : search space of the schedulers and their knobs
+    double weights[3] = {1, 1, 1}; // tuning mode : weights of tot_movement, average turnaround and p99 wait (-o flag)
+    int merge_window = -1; // merge stage : -g<window>[,<max>] (-1 : no merging)
+    int merge_max = 32;
+    int nb_test_traces = 0; // validation mode : -V<traces>[,<seed>]
+    unsigned test_seed = 1;
+    bool Iflag = false; // count the time and the hardware counters of each phase of the run
+    SchedulerConfig config; // tunables of the schedulers : -E<expire>[,<fifo_batch>] for DEADLINE, -M<model> for SATF
     int o;
 
-    
+
     opterr = 0;
 
-    while ((o = getopt (argc, argv, "s:vqf")) != -1)
+    while ((o = getopt (argc, argv, "s:vqfeb:SmBC:w:j:G:x:d:D:pH:r:PE:M:T:F:W:R:Q:O:g:U:o:V:IK:")) != -1)
         switch (o)
         {
         case 's':
@@ -621,8 +1821,144 @@ int main(int argc, char *argv[]) {
         case 'f':
             fflag = true;
             break;
+        case 'e':
+            eflag = true;
+            break;
+        case 'I':
+            Iflag = true;
+            break;
+        case 'b':
+            bvalue = optarg[0];
+            break;
+        case 'S':
+            Sflag = true;
+            break;
+        case 'm':
+            mflag = true;
+            break;
+        case 'B':
+            Bflag = true;
+            break;
+        case 'C':
+            Cvalue = optarg;
+            break;
+        case 'w':
+            wvalue = optarg;
+            break;
+        case 'j':
+            nb_threads = atoi(optarg);
+            break;
+        case 'G':
+            Gvalue = optarg;
+            break;
+        case 'x':
+            xvalue = optarg;
+            break;
+        case 'p':
+            pflag = true;
+            break;
+        case 'H':
+            Hvalue = optarg;
+            break;
+        case 'D':
+            Dvalue = optarg;
+            break;
+        case 'r':
+            rvalue = optarg;
+            break;
+        case 'P':
+            Pflag = true;
+            break;
+        case 'M':
+            if ( !parse_cost_model(optarg, &config.cost_model) ) {
+                fprintf (stderr, "Option -M requires l or c[,<settle>,<sqrt_coef>,<knee>,<linear_coef>,<rotation>,<transfer>].\n");
+                return -1;
+            }
+            break;
+        case 'T':
+            Tvalue = optarg;
+            break;
+        case 'F':
+            Fvalue = optarg;
+            break;
+        case 'W':
+            Wvalue = optarg;
+            break;
+        case 'R':
+            Rvalue = optarg;
+            break;
+        case 'E':
+            if (sscanf(optarg, "%d,%d", &config.expire, &config.fifo_batch) < 1 || config.expire < 0 || config.fifo_batch < 1) {
+                fprintf (stderr, "Option -E requires <expire>[,<fifo_batch>].\n");
+                return -1;
+            }
+            break;
+        case 'Q':
+            multi_queue_config.nb_hw_queues = 0;
+            if (sscanf(optarg, "%d,%d,%d", &multi_queue_config.nb_producers, &multi_queue_config.nb_hw_queues,
+                       &multi_queue_config.depth) < 1 || multi_queue_config.nb_producers < 1
+                || multi_queue_config.nb_hw_queues < 0 || multi_queue_config.depth < 1) {
+                fprintf (stderr, "Option -Q requires <producers>[,<hwqueues>[,<depth>]].\n");
+                return -1;
+            }
+            if (multi_queue_config.nb_hw_queues == 0 || multi_queue_config.nb_hw_queues > multi_queue_config.nb_producers) {
+                multi_queue_config.nb_hw_queues = multi_queue_config.nb_producers;
+            }
+            break;
+        case 'O':
+            if (strcmp(optarg, "f") != 0 && strcmp(optarg, "d") != 0) {
+                fprintf (stderr, "Option -O requires f (fixed merge order) or d (drain order).\n");
+                return -1;
+            }
+            multi_queue_config.fixed_order = (optarg[0] == 'f');
+            break;
+        case 'U':
+            Uvalue = optarg;
+            break;
+        case 'o':
+            if (sscanf(optarg, "%lf,%lf,%lf", &weights[0], &weights[1], &weights[2]) != 3
+                || weights[0] < 0 || weights[1] < 0 || weights[2] < 0) {
+                fprintf (stderr, "Option -o requires <movement>,<turnaround>,<tail> weights.\n");
+                return -1;
+            }
+            break;
+        case 'g':
+            if (sscanf(optarg, "%d,%d", &merge_window, &merge_max) < 1 || merge_window < 0 || merge_max < 1) {
+                fprintf (stderr, "Option -g requires <window>[,<max>].\n");
+                return -1;
+            }
+            break;
+        case 'K':
+            {
+                // <budget>[,<weight of stream 0>[,<weight of stream 1>...]]
+                vector<string> fields = split(optarg, ',');
+                char* end;
+                config.fair_budget = strtol(fields[0].c_str(), &end, 10);
+                bool ok = !fields[0].empty() && *end == '\0' && config.fair_budget >= 0;
+                for (size_t f = 1; ok && f < fields.size(); f++) {
+                    config.stream_weights.push_back(strtol(fields[f].c_str(), &end, 10));
+                    ok = !fields[f].empty() && *end == '\0' && config.stream_weights.back() >= 1;
+                }
+                if (!ok) {
+                    fprintf (stderr, "Option -K requires <budget>[,<weight>...] (weights of streams 0, 1, ...).\n");
+                    return -1;
+                }
+            }
+            break;
+        case 'V':
+            if (sscanf(optarg, "%d,%u", &nb_test_traces, &test_seed) < 1 || nb_test_traces < 1) {
+                fprintf (stderr, "Option -V requires <traces>[,<seed>].\n");
+                return -1;
+            }
+            break;
+        case 'd':
+            if (sscanf(optarg, "%d,%d", &nb_devices, &stripe) < 1 || nb_devices < 1 || stripe < 1) {
+                fprintf (stderr, "Option -d requires <devices>[,<stripe>].\n");
+                return -1;
+            }
+            break;
         case '?':
-            if (optopt == 's') {
+            if (strchr("sbCwjGxdDHrEMTFWRQOgUoVK", optopt) != NULL) {
                 fprintf (stderr, "Option -%c requires an argument.\n", optopt);
             }
             else if (isprint (optopt)) {
@@ -638,58 +1974,274 @@ int main(int argc, char *argv[]) {
             abort ();
         }
 
-    if (argc - optind < 1 ) { 
-        printf("Please give an input file\n"); 
-        return -1; 
+    // These modes don't need an input file
+    if (Gvalue != NULL) {
+        Workload workload;
+        if ( !parse_workload(Gvalue, workload) ) {
+            printf("Please give a workload as <poisson|bursty|hotspot|tenants>,<numio>,<maxtracks>,<lambda>[,<seed>]\n");
+            return -1;
+        }
+        IO_pool io_ops;
+        generate_workload(workload, io_ops);
+        write_workload(workload, io_ops, stdout);
+        return 0;
+    }
+    if (xvalue != NULL) {
+        return benchmark(xvalue);
+    }
+    if (nb_test_traces > 0) {
+        return validate(nb_test_traces, test_seed, sflag ? svalue : "ijscfdaw", max(nb_threads, 1));
+    }
+
+    if (argc - optind < 1 ) {
+        printf("Please give an input file\n");
+        return -1;
+    }
+    else if (wvalue != NULL) {
+        // Sweep mode : all the schedulers given by -s (all of them by default) on all the input files
+        if (merge_window >= 0) {
+            fprintf(stderr, "The merge stage can't be used with -w.\n");
+            return -1;
+        }
+        if (nb_threads < 1) {
+            nb_threads = 1;
+        }
+        return sweep(argv + optind, argc - optind, sflag ? svalue : "ijscfdaw", wvalue, nb_threads,
+                     bvalue, config, eflag, Bflag, mflag) == 0 ? 0 : -1;
     }
-    else if (argc - optind > 1) { 
-        printf("Please put only 1 input file\n"); 
-        return -1; 
+    else if (Uvalue != NULL) {
+        // Tuning mode : all the configurations of the search space on all the input files
+        return tune(argv + optind, argc - optind, Uvalue, weights, max(nb_threads, 1), bvalue, config, Bflag, mflag);
+    }
+    else if (argc - optind > 1) {
+        printf("Please put only 1 input file\n");
+        return -1;
     }
     // Now we know we have an input file and a random file as non-option arguments
     ifstream input_file ( argv[optind] ); // input file
 
     // Check if file opening succeeded
     if ( !input_file.is_open() ) {
-        cout<< "Could not open the input file \n"; 
+        cout<< "Could not open the input file \n";
+        return -1;
+    }
+
+    if (Cvalue != NULL) {
+        if ( !convertTrace(argv[optind], Cvalue) ) {
+            cout<< "Could not convert the input file \n";
+            return -1;
+        }
+        return 0;
+    }
+
+    ReplayConfig replay_config;
+    if (rvalue != NULL) {
+        if ( !parse_replay(rvalue, replay_config) ) {
+            fprintf(stderr, "Option -r requires <file>[,<depth>[,<track_size>]].\n");
+            return -1;
+        }
+        if (Sflag) {
+            fprintf(stderr, "The replay mode needs the whole trace, it can't be used with -S.\n");
+            return -1;
+        }
+        replay_config.force_pread = Pflag;
+    }
+    if ( (Tvalue != NULL || Rvalue != NULL) && Sflag ) {
+        fprintf(stderr, "The snapshots need the whole trace, they can't be used with -S.\n");
+        return -1;
+    }
+    if ( multi_queue_config.nb_producers > 0 && (rvalue != NULL || Tvalue != NULL || Rvalue != NULL || Sflag || nb_devices > 0) ) {
+        fprintf(stderr, "The multi-queue mode can't be used with -r, -T, -R, -S or -d.\n");
+        return -1;
+    }
+    if ( merge_window >= 0 && (Tvalue != NULL || Rvalue != NULL || nb_devices > 0 || multi_queue_config.nb_producers > 0) ) {
+        fprintf(stderr, "The merge stage can't be used with -T, -R, -d or -Q.\n");
+        return -1;
+    }
+    if ( (Fvalue != NULL || Wvalue != NULL) && Tvalue == NULL ) {
+        fprintf(stderr, "Options -F and -W require the time of the snapshot with -T<time> or -T@<oid>.\n");
         return -1;
     }
 
     // Process input file to initialize the IO operations
-    readInput(input_file);
+    IO_pool io_ops;
+    IO_input* input;
+    StreamInput* stream_input = NULL;
+    PhaseCounters* counters = Iflag ? new PhaseCounters() : NULL;
+    if (nb_devices > 0) {
+        // Every loader reads the device column. The whole trace is needed to split it over the devices
+        if ( !load_trace(argv[optind], io_ops, Bflag, mflag) ) {
+            cout<< "Could not load the input file \n";
+            return -1;
+        }
+        if (nb_threads < 1) {
+            nb_threads = 1;
+        }
+        return multi_device(io_ops, nb_devices, stripe, svalue != NULL ? svalue[0] : 0, bvalue, config, nb_threads, pflag);
+    }
+    if (multi_queue_config.nb_producers > 0) {
+        // The producers replay the whole trace, the simulator gets its IO operations from the dispatcher
+        if ( !load_trace(argv[optind], io_ops, Bflag, mflag) ) {
+            cout<< "Could not load the input file \n";
+            return -1;
+        }
+        return multi_queue(io_ops, multi_queue_config, svalue != NULL ? svalue[0] : 0, bvalue, config, eflag, pflag);
+    }
+    if (counters != NULL) {
+        counters->start(PHASE_LOAD);
+    }
+    if (Bflag) {
+        if ( !loadBinaryInput(argv[optind], io_ops) ) {
+            cout<< "Could not load the input file \n";
+            return -1;
+        }
+        input = new VectorInput(&io_ops);
+    } else if (Sflag) {
+        stream_input = new StreamInput(input_file, &io_ops);
+        input = stream_input;
+    } else if (mflag) {
+        if ( !loadInput(argv[optind], io_ops) ) {
+            cout<< "Could not load the input file \n";
+            return -1;
+        }
+        input = new VectorInput(&io_ops);
+    } else {
+        if ( !readInput(input_file, io_ops) ) {
+            cout<< "Could not load the input file \n";
+            return -1;
+        }
+        input = new VectorInput(&io_ops);
+    }
+    if (counters != NULL) {
+        // In streaming mode the trace is parsed during the simulation
+        counters->stop(PHASE_LOAD);
+    }
 
 
     // Define the scheduler
-    Scheduler* scheduler;
-    switch (svalue[0]) {
+    Scheduler* scheduler = new_scheduler(svalue != NULL ? svalue[0] : 0, &io_ops, bvalue, config);
+    if (scheduler == NULL) {
+        printf("Please give a scheduler with -s among i, j, s, c, f, d, a and w\n");
+        return -1;
+    }
 
-        case 'i' : {
-            scheduler = new FIFO();
-            break;
+    Simulator simulator = Simulator(scheduler, &io_ops, input, Sflag);
+    simulator.cost_model = config.cost_model;
+    simulator.merge_window = merge_window;
+    simulator.merge_max = merge_max;
+    simulator.counters = counters;
+    if (vflag || qflag || fflag) {
+        simulator.tracer = new Tracer(1 << 20, vflag, qflag, fflag);
+    }
+    vector<op_index> issue_order;
+    if (rvalue != NULL) {
+        simulator.issue_order = &issue_order;
+    }
+
+    // Snapshots : resume from the file of -R, then stop at the time of -T to save (-W) or fork (-F) the simulation
+    char algo = svalue[0];
+    if (Rvalue != NULL) {
+        Snapshot snapshot;
+        if ( !load_snapshot(Rvalue, snapshot, io_ops) ) {
+            cout<< "Could not load the snapshot file \n";
+            return -1;
         }
-        case 'j' : {
-            scheduler = new SSTF();
-            break;
+        restore_snapshot(simulator, algo, snapshot);
+    }
+    if (Tvalue != NULL) {
+        simulator.stop_time = parse_snapshot_time(Tvalue, io_ops);
+        if (simulator.stop_time < 0) {
+            fprintf(stderr, "Option -T requires <time> or @<oid> in the trace.\n");
+            return -1;
         }
-        case 's' : {
-            scheduler = new LOOK();
-            break;
+        run_simulation(simulator, eflag);
+        if ( !check_end_times(simulator) ) {
+            return -1;
         }
-        case 'c' : {
-            scheduler = new CLOOK();
-            break;
+        Snapshot snapshot;
+        take_snapshot(simulator, algo, snapshot);
+        print_snapshot(snapshot, io_ops);
+        if (Wvalue != NULL && !save_snapshot(Wvalue, snapshot, io_ops)) {
+            cout<< "Could not write the snapshot file \n";
+            return -1;
         }
-        case 'f' : {
-            scheduler = new FLOOK();
-            break;
+        if (Fvalue != NULL) {
+            return fork_snapshot(snapshot, io_ops, Fvalue, bvalue, config, eflag, max(nb_threads, 1), pflag);
         }
+        return 0;
+    }
 
+    if (counters != NULL) {
+        counters->start(PHASE_SIMULATION);
+    }
+    run_simulation(simulator, eflag);
+    if (counters != NULL) {
+        counters->stop(PHASE_SIMULATION);
+    }
+    // In streaming mode the IO operations before the bad one are already printed, but there is no SUM line
+    if (stream_input != NULL && stream_input->failed) {
+        cout<< "Could not load the input file \n";
+        return -1;
+    }
+    if ( !check_end_times(simulator) ) {
+        return -1;
     }
 
-    Simulator simulator = Simulator(scheduler);
-    simulator.simulation();
+    // Replay mode : read the tracks from the file in the order they were issued
+    vector<int64_t> latency;
+    ReplayStats replay_stats;
+    if (rvalue != NULL) {
+        if ( !replay(replay_config, io_ops, issue_order, latency, replay_stats) ) {
+            cout<< "Could not replay on the file \n";
+            return -1;
+        }
+        simulator.measured_latency = &latency;
+    }
 
+    if (simulator.tracer != NULL) {
+        if (Dvalue != NULL) {
+            if ( !simulator.tracer->dump(Dvalue) ) {
+                cout<< "Could not write the trace file \n";
+            }
+        } else {
+            simulator.tracer->print(stdout);
+        }
+    }
+
+    if (counters != NULL) {
+        counters->start(PHASE_OUTPUT);
+    }
     simulator.print_summary();
+    if (counters != NULL) {
+        fflush(stdout); // the printf of the IO operations is done when the buffer is written
+        counters->stop(PHASE_OUTPUT);
+    }
+    if (merge_window >= 0) {
+        simulator.print_merge();
+    }
+    bool has_streams = !io_ops.stream.empty();
+    if (has_streams) {
+        simulator.print_streams();
+    }
+    if (rvalue != NULL) {
+        print_replay(replay_config, replay_stats, issue_order.size());
+    }
+    if (pflag) {
+        simulator.print_percentiles();
+        if (has_streams) {
+            simulator.print_stream_percentiles();
+        }
+        if (rvalue != NULL) {
+            replay_stats.latency_histogram.print_percentiles(stdout, "latency");
+        }
+    }
+    if (Hvalue != NULL && !simulator.dump_histograms(Hvalue)) {
+        cout<< "Could not write the histogram file \n";
+    }
+    if (counters != NULL) {
+        counters->print(stdout, simulator.nb_io_ops);
+        delete counters;
+    }
 
 
-}
\ No newline at end of file
+}
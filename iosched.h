@@ -0,0 +1,75 @@
+// libiosched : the disk schedulers of iosched (FIFO, SSTF, LOOK, CLOOK, FLOOK, DEADLINE, SATF, FAIRSHARE) behind an
+// online API, to order the requests of a real IO submission path instead of a simulated trace.
+//
+//   iosched::OnlineScheduler* sched = iosched::OnlineScheduler::create('s', 't'); // LOOK, tree request queue
+//   sched->submit(track, tag);           // a request arrives. The tag is chosen by the caller, e.g. a request id
+//   uint64_t tag;
+//   if (sched->next(head, &tag)) { ... } // the device is idle with its head on track head : dispatch tag
+//   sched->complete(tag);                // the device is done with tag
+//   delete sched;
+//
+// There is no global state : each OnlineScheduler owns its requests, and all its methods lock an internal mutex,
+// so a scheduler can be shared by the threads that submit and the threads that complete the requests.
+// Build with make lib, then link with libiosched.a or libiosched.so (and -pthread).
+#ifndef IOSCHED_H
+#define IOSCHED_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <map>
+#include <mutex>
+#include <vector>
+
+class Scheduler;
+class IO_pool;
+
+namespace iosched {
+
+class OnlineScheduler {
+    public:
+        // algo is a letter of the -s flag of iosched : i (FIFO), j (SSTF), s (LOOK), c (CLOOK), f (FLOOK), d (DEADLINE),
+        // a (SATF, with the linear model : the same as SSTF) or w (FAIRSHARE : all the requests are in stream 0, so
+        // it behaves like SSTF)
+        // backend is a letter of the -b flag : v (scan), t (tree), s (SIMD) or h (bitmap). See the README
+        // expire_ms and fifo_batch are the tunables of DEADLINE, like the -E flag, with the time in ms. expire_ms must be
+        // well above the time the device takes to serve its queue, or every batch starts with the oldest request
+        // NULL if algo is unknown
+        static OnlineScheduler* create(char algo, char backend = 't', int expire_ms = 500, int fifo_batch = 16);
+
+        ~OnlineScheduler();
+
+        // Add a request for track. False if the track is negative or above the largest track of the build (2^31 - 1,
+        // or 2^40 with -DIOSCHED_LARGE_DISK), or if tag is already submitted and not completed
+        bool submit(int64_t track, uint64_t tag);
+
+        // Remove the request to dispatch now, given the track of the head, and return its tag in *tag
+        // False if there is no pending request, or if head is not a valid track
+        bool next(int64_t head, uint64_t* tag);
+
+        // The dispatched request tag is done. False if tag was not returned by next() or was already completed
+        bool complete(uint64_t tag);
+
+        size_t pending(); // Requests submitted and not dispatched yet
+        size_t in_flight(); // Requests dispatched and not completed yet
+
+    private:
+        OnlineScheduler(Scheduler* scheduler_, IO_pool* io_ops_);
+        int64_t now_ms();
+        OnlineScheduler(const OnlineScheduler&);
+        OnlineScheduler& operator=(const OnlineScheduler&);
+
+        std::mutex lock;
+        IO_pool* io_ops; // track of each request, one slot per request not completed yet
+        Scheduler* scheduler;
+        std::vector<uint64_t> tags; // tag of each slot of the pool
+        std::vector<bool> dispatched; // if each slot of the pool was returned by next()
+        std::map<uint64_t, uint32_t> slots; // slot of each tag not completed yet
+        size_t nb_pending;
+        int64_t created_ns; // the clock of the scheduler starts at the creation...
+        int64_t epoch_ms; // ...plus epoch_ms : it restarts from 0 before it overflows 32 bits (see now_ms)
+};
+
+}
+
+#endif
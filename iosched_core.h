@@ -0,0 +1,2630 @@
+// Internal header of libiosched : the IO pool, the trace loaders, the request queues, the schedulers and the simulator.
+// Shared by the library and by the iosched command line driver. Applications use the public API of iosched.h instead.
+#ifndef IOSCHED_CORE_H
+#define IOSCHED_CORE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+
+#include <sstream>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <queue>
+#include <deque>
+#include <stack>
+#include <map>
+#include <unordered_map>
+#include <list>
+#include <algorithm>
+#include <vector>
+#include <memory>
+
+using namespace std;
+
+//-------------------- STEP 1 : Create the IO operation structure --------------------
+// The IO operations are not allocated one by one : they all live in a pool, and the queues refer to them by a 32-bit index.
+// The fields read at every step of the simulation (track, arrival_time) are stored in their own contiguous arrays.
+// The results are stored apart, by each simulator : a pool loaded once can be shared read-only by many simulations.
+
+typedef uint32_t op_index; // index of an IO operation in the pool
+const op_index NO_OP = UINT32_MAX; // plays the role of NULL for an op_index
+
+// Large-disk mode (make large, which defines IOSCHED_LARGE_DISK) : the times, the tracks and the movement are 64-bit,
+// for long traces and track numbers up to 2^40. Otherwise they are 32-bit, so the pool and the queues stay small.
+// They are printed with %lld and a cast to long long, which gives the same output in both modes.
+#ifdef IOSCHED_LARGE_DISK
+typedef int64_t io_time;
+typedef int64_t io_track;
+const io_time MAX_TIME = INT64_MAX;
+const io_track MAX_TRACK = (io_track) 1 << 40;
+#else
+typedef int io_time;
+typedef int io_track;
+const io_time MAX_TIME = INT_MAX;
+const io_track MAX_TRACK = INT_MAX;
+#endif
+
+// Fields only written when the IO operation is issued or completed, and read for the summary
+struct IO_result {
+    io_time start_time; // time when the IO operation starts
+    io_time end_time; // time when the IO operation ends
+    io_time turnaround_time; // turn around time. Used to compute summary
+    io_time wait_time; // wait time from being submitted to start being executed
+};
+
+// Results of a simulation, indexed like the pool, in chunks of 4096 IO operations.
+// The chunks are shared by the simulations forked from a snapshot (STEP 5bis) : a chunk is only copied when one of
+// them writes into it while another one still uses it. So a fork doesn't duplicate the results of the whole trace,
+// only the chunks of the IO operations issued after the snapshot.
+class ResultStore {
+    static const int CHUNK_BITS = 12;
+    static const size_t CHUNK_SIZE = 1 << CHUNK_BITS;
+    vector< shared_ptr< vector<IO_result> > > chunks;
+    size_t nb_results;
+
+    public:
+        ResultStore() {
+            nb_results = 0;
+        }
+
+        size_t size() const {
+            return nb_results;
+        }
+
+        // Only grows
+        void resize(size_t nb_results_) {
+            while (chunks.size() * CHUNK_SIZE < nb_results_) {
+                chunks.push_back(make_shared< vector<IO_result> >((size_t) CHUNK_SIZE)); // a copy : CHUNK_SIZE has no definition to bind a reference to
+            }
+            nb_results = max(nb_results, nb_results_);
+        }
+
+        const IO_result& operator[](op_index io_op) const {
+            return (*chunks[io_op >> CHUNK_BITS])[io_op & (CHUNK_SIZE - 1)];
+        }
+
+        // Result to modify : its chunk is copied first if it is shared
+        IO_result& write(op_index io_op) {
+            shared_ptr< vector<IO_result> >& chunk = chunks[io_op >> CHUNK_BITS];
+            if (chunk.use_count() > 1) {
+                chunk = make_shared< vector<IO_result> >(*chunk);
+            }
+            return (*chunk)[io_op & (CHUNK_SIZE - 1)];
+        }
+};
+
+class IO_pool {
+    public:
+        // Hot fields
+        vector<int> oid; // id of the operation. Could also use the arrival_time since there are no overlap
+        vector<io_time> arrival_time; // time when IO operation is issued
+        vector<io_track> track; // track that is accessed
+        vector<int> device; // optional 3rd column of the input : device of the IO operation. Empty if the input has none
+        vector<int> stream; // optional 4th column : stream (tenant) that submitted the IO operation. Empty if none
+
+        vector<op_index> free_slots; // slots released by completed IO operations (streaming mode), reused first
+
+        op_index alloc(int oid_, io_time arrival_time_, io_track track_) {
+            if (!free_slots.empty()) {
+                op_index io_op = free_slots.back();
+                free_slots.pop_back();
+                oid[io_op] = oid_;
+                arrival_time[io_op] = arrival_time_;
+                track[io_op] = track_;
+                return io_op;
+            }
+            oid.push_back(oid_);
+            arrival_time.push_back(arrival_time_);
+            track.push_back(track_);
+            return oid.size() - 1;
+        }
+
+        void release(op_index io_op) {
+            free_slots.push_back(io_op);
+        }
+
+        op_index size() const {
+            return oid.size();
+        }
+
+        void set_device(op_index io_op, int device_) {
+            if (device.size() <= io_op) {
+                device.resize(io_op + 1, 0);
+            }
+            device[io_op] = device_;
+        }
+
+        int device_of(op_index io_op) const {
+            return (io_op < device.size()) ? device[io_op] : 0;
+        }
+
+        void set_stream(op_index io_op, int stream_) {
+            if (stream.size() <= io_op) {
+                stream.resize(io_op + 1, 0);
+            }
+            stream[io_op] = stream_;
+        }
+
+        int stream_of(op_index io_op) const {
+            return (io_op < stream.size()) ? stream[io_op] : 0;
+        }
+
+        void reserve(size_t nb_io_ops) {
+            oid.reserve(nb_io_ops);
+            arrival_time.reserve(nb_io_ops);
+            track.reserve(nb_io_ops);
+        }
+};
+
+
+//-------------------- STEP 2 : Read Input File and initialize the IO operations queue --------------------
+// Now, we can read the input file and initialize the IO operations queue
+
+// Header of a trace, as written by the io generator in the comment line "#numio=10 maxtracks=128 lambda=0.100000"
+struct TraceHeader {
+    long long numio;
+    long long maxtracks;
+    double lambda;
+
+    TraceHeader() {
+        numio = 0;
+        maxtracks = 0;
+        lambda = 0;
+    }
+};
+
+// Check the nb_columns values of the IO operation count of a text trace (arrival time, track, then the optional device
+// and stream), read as long long. False, with an error on the standard error, if one is negative or too large
+inline bool check_io_op(int count, int nb_columns, long long arrival_time, long long track, long long device,
+                        long long stream) {
+    bool bad_device = nb_columns >= 3 && (device < 0 || device > INT_MAX);
+    bool bad_stream = nb_columns >= 4 && (stream < 0 || stream > INT_MAX);
+    if (arrival_time < 0 || track < 0 || bad_device || bad_stream) {
+        fprintf(stderr, "IO operation %d has a negative or out of range value\n", count);
+        return false;
+    }
+    if (arrival_time > MAX_TIME || track > MAX_TRACK) {
+        fprintf(stderr, "IO operation %d out of range (see the large-disk mode in the README)\n", count);
+        return false;
+    }
+    return true;
+}
+
+// Readers and writers of the traces. Defined in libiosched.cpp
+bool readInput(istream& input_file, IO_pool& io_ops); // Text trace, with the iostreams. False if a value is out of range
+bool map_file(const char* path, const char** data, size_t* size); // Map a whole file in memory for a sequential read
+void report_load(const char* path, int count, size_t size, struct timespec& start); // Print the loading throughput
+bool loadInput(const char* path, IO_pool& io_ops, TraceHeader* header = NULL); // Text trace, memory-mapped (-m flag)
+bool is_binary_trace(const char* path);
+bool loadBinaryInput(const char* path, IO_pool& io_ops, TraceHeader* header = NULL); // Binary trace (-B flag)
+bool writeBinaryTrace(const char* path, IO_pool& io_ops, TraceHeader& header);
+bool writeTextTrace(const char* path, IO_pool& io_ops, TraceHeader& header);
+bool convertTrace(const char* input_path, const char* output_path); // -C flag
+
+
+// The simulator pulls the IO operations from an input source as the CLOCK reaches their arrival time
+// Either from the pool filled by readInput(), or straight from the file (streaming mode)
+class IO_input {
+    public:
+        virtual op_index peek() = 0; // Next IO operation to arrive. NO_OP if there are no more
+        virtual op_index next() = 0; // Remove the next IO operation from the input and return it
+        virtual void release(op_index /*io_op*/) {} // The IO operation was printed, its slot can be reused
+        virtual ~IO_input() {}
+};
+
+
+class VectorInput: public IO_input {
+    const IO_pool* io_ops;
+    op_index hand_input; // index of current input IO operation. Used to imitate the behavior of a queue
+
+    public:
+        VectorInput(const IO_pool* io_ops_) {
+            io_ops = io_ops_;
+            hand_input = 0;
+        }
+
+        op_index peek() {
+            if (hand_input < io_ops->size()) {
+                return hand_input;
+            }
+            return NO_OP;
+        }
+
+        op_index next() {
+            op_index io_op = peek();
+            hand_input++;
+            return io_op;
+        }
+
+        // Number of IO operations already taken from the input. The snapshots save it and restore it with seek()
+        op_index position() {
+            return hand_input;
+        }
+
+        void seek(op_index hand_input_) {
+            hand_input = hand_input_;
+        }
+};
+
+
+// Streaming mode : only the next IO operation is parsed in advance, the rest of the file is read lazily
+// Memory is then bounded by the IO operations in flight, not by the size of the trace
+class StreamInput: public IO_input {
+    istream& input_file;
+    IO_pool* io_ops;
+    op_index lookahead; // next IO operation to arrive, already parsed
+    int count; // Same as oid. We use the order of arrival as the oid of the IO operation
+
+    void read_next() {
+        lookahead = NO_OP;
+        string line;
+        while ( !failed && getline(input_file, line) ) {
+            // Comments can be anywhere in the file
+            if (line.empty() || line[0] == '#') {
+                continue;
+            }
+            long long arrival_time, track, device, stream;
+            int nb_columns = sscanf(line.c_str(), "%lld %lld %lld %lld", &arrival_time, &track, &device, &stream);
+            if (nb_columns < 2) {
+                continue;
+            }
+            // The rest of the trace is not read : the simulation ends with the IO operations before this one
+            if ( !check_io_op(count, nb_columns, arrival_time, track, device, stream) ) {
+                failed = true;
+                return;
+            }
+            lookahead = io_ops->alloc(count, arrival_time, track);
+            // A reused slot keeps the stream of its previous IO operation unless we overwrite it
+            if (nb_columns == 4) {
+                io_ops->set_stream(lookahead, (int) stream);
+            } else if ( !io_ops->stream.empty() ) {
+                io_ops->set_stream(lookahead, 0);
+            }
+            count++;
+            return;
+        }
+    }
+
+    public:
+        bool failed; // an IO operation of the file is out of range
+
+        StreamInput(istream& input_file_, IO_pool* io_ops_): input_file(input_file_) {
+            io_ops = io_ops_;
+            count = 0;
+            failed = false;
+            read_next();
+        }
+
+        op_index peek() {
+            return lookahead;
+        }
+
+        op_index next() {
+            op_index io_op = lookahead;
+            read_next();
+            return io_op;
+        }
+
+        void release(op_index io_op) {
+            io_ops->release(io_op);
+        }
+};
+
+
+//-------------------- STEP 3 : Create Abstract class for Scheduler Algorithms --------------------
+
+class Scheduler {
+    public:
+        io_track head;
+        op_index curr_io_op;
+        bool isCompleted; // check if the current IO_operation is completed
+        const IO_pool* io_ops; // where the IO operations are stored
+        int nb_swaps; // number of times the add_queue and the active_queue were swapped (FLOOK only)
+        io_time clock; // current time, set by the caller before each strategy() call (DEADLINE only)
+
+        virtual op_index strategy() = 0; // Choose next IO operation given the request queue. To be implemented by each scheduler
+        virtual void move_head(); // Move head one track toward the current IO operation. Same for all the schedulers but FIFO
+        virtual void add_request(op_index io_op) = 0; // Add the newly arrived IO operation to request queue. Scheduler dependant because it depends on if the request queue is a queue, a vector etc
+        virtual bool hasRequest() = 0; // Check if the request queue is empty or not. Scheduler dependant because it depends on if the request queue is a queue or a vector etc
+        virtual void queue_contents(vector<op_index>& ops, int queue) = 0; // List the pending requests for the trace. queue 1 is the add_queue of FLOOK
+
+        // Snapshots (STEP 5bis). The state of the scheduler besides its queues and its head, e.g. the direction of LOOK
+        virtual int save_state() {
+            return 0;
+        }
+
+        // Put back the pending requests of queue 0 and 1 (as listed by queue_contents(), in order of arrival)
+        // and the state given by save_state()
+        virtual void restore(const vector<op_index>* queues, int /*state*/) {
+            for (int queue = 0; queue < 2; queue++) {
+                for (size_t i = 0; i < queues[queue].size(); i++) {
+                    add_request(queues[queue][i]);
+                }
+            }
+        }
+
+        // The state that doesn't fit in an int (FAIRSHARE : the virtual times of the streams). Restored after restore()
+        virtual void save_extra_state(vector<int64_t>& /*extra*/) {}
+        virtual void restore_extra_state(const vector<int64_t>& /*extra*/) {}
+
+        Scheduler(const IO_pool* io_ops_) {
+            head = 0;
+            curr_io_op = NO_OP;
+            isCompleted = false;
+            io_ops = io_ops_;
+            nb_swaps = 0;
+            clock = 0;
+        }
+
+        virtual ~Scheduler() {}
+
+        // Move the head several tracks at once toward the current IO operation (used by the event-driven simulation)
+        // The caller guarantees that we never overshoot the target track
+        void jump_head(io_track steps) {
+            io_track track = io_ops->track[curr_io_op];
+            if ( head < track ) {
+                head += steps;
+            } else {
+                head -= steps;
+            }
+            if (head == track) {
+                isCompleted = true;
+            }
+        }
+
+};
+
+// Move head toward a target track
+inline void Scheduler::move_head() {
+    io_track track = io_ops->track[curr_io_op];
+    // Careful of edge case : if head is already on the track of a new operation, we don't move it
+    if ( head < track ) {
+        head++;
+    } else if ( head > track ) {
+        head--;
+    }
+
+    if (head == track) {
+        isCompleted = true;
+    }
+}
+
+//-------------------- STEP 3bis : Create the request queues used by the schedulers --------------------
+// SSTF, LOOK, CLOOK and FLOOK all pick a request by its track relatively to the head.
+// The request queue is pluggable so we can choose how these lookups are done :
+//   - ScanQueue : a vector scanned linearly for every lookup (O(n) per dispatch)
+//   - TreeQueue : a balanced tree ordered by track (O(log n) per dispatch)
+//   - SimdQueue : like ScanQueue, but the scan runs on 4 or 8 tracks at once with SSE4.1 or AVX2 instructions
+// Whatever the backend, ties between requests on the same track (or at the same distance) go to the
+// request that was pushed first, i.e. the one that arrived first. So all backends produce exactly the same dispatch order.
+// The queues keep their own copy of the track of each request, so a lookup never touches the pool.
+
+class RequestQueue {
+    public:
+        virtual void push(op_index io_op, io_track track) = 0; // Add a request to the queue
+        virtual bool empty() = 0;
+        virtual op_index pop_nearest(io_track head) = 0; // Remove and return the request closest to the head (SSTF)
+        virtual op_index pop_at_or_above(io_track from) = 0; // Remove and return the lowest track >= from. NO_OP if none
+        virtual op_index pop_at_or_below(io_track from) = 0; // Remove and return the highest track <= from. NO_OP if none
+        virtual void contents(vector<op_index>& ops) = 0; // Append all the requests of the queue to ops
+        virtual ~RequestQueue() {}
+};
+
+
+class ScanQueue: public RequestQueue {
+    // Two parallel vectors in order of arrival : the scan only reads the contiguous tracks
+    vector<io_track> tracks;
+    vector<op_index> request_queue;
+
+    // Return the request minimizing the distance, in a direction given by sign (1: forward, -1: backward, 0: both)
+    // Only a strictly shorter distance replaces the candidate, so ties are won by the first request in the vector
+    op_index pop_closest(io_track from, int sign) {
+        int shortest_pos = -1; // To erase from the queue later
+        io_track shortest_distance = -1;
+
+        for (int pos = 0; pos < (int) tracks.size(); pos++) {
+            io_track distance = tracks[pos] - from;
+            // the conditions check if we are going in the requested direction
+            if ( (sign > 0 && distance < 0) || (sign < 0 && distance > 0) ) {
+                continue;
+            }
+            if ( (shortest_pos == -1) || (abs(distance) < shortest_distance) ) {
+                shortest_distance = abs(distance);
+                shortest_pos = pos;
+            }
+        }
+        if (shortest_pos == -1) {
+            return NO_OP;
+        }
+        op_index next_io_op = request_queue[shortest_pos];
+        tracks.erase(tracks.begin() + shortest_pos);
+        request_queue.erase(request_queue.begin() + shortest_pos);
+        return next_io_op;
+    }
+
+    public:
+        void push(op_index io_op, io_track track) {
+            tracks.push_back(track);
+            request_queue.push_back(io_op);
+        }
+
+        bool empty() {
+            return request_queue.empty();
+        }
+
+        op_index pop_nearest(io_track head) {
+            return pop_closest(head, 0);
+        }
+
+        op_index pop_at_or_above(io_track from) {
+            return pop_closest(from, 1);
+        }
+
+        op_index pop_at_or_below(io_track from) {
+            return pop_closest(from, -1);
+        }
+
+        void contents(vector<op_index>& ops) {
+            ops.insert(ops.end(), request_queue.begin(), request_queue.end());
+        }
+};
+
+
+class TreeQueue: public RequestQueue {
+    // Requests ordered by (track, order of push). For a given track, the first request is the one that arrived first
+    map< pair<io_track, long long>, op_index > request_queue;
+    typedef map< pair<io_track, long long>, op_index >::iterator iterator;
+    long long nb_pushed;
+
+    // First request on the lowest track >= from
+    iterator find_at_or_above(io_track from) {
+        return request_queue.lower_bound(make_pair(from, LLONG_MIN));
+    }
+
+    // First request on the highest track <= from
+    iterator find_at_or_below(io_track from) {
+        iterator it = request_queue.upper_bound(make_pair(from, LLONG_MAX));
+        if (it == request_queue.begin()) {
+            return request_queue.end();
+        }
+        it--;
+        return find_at_or_above(it->first.first);
+    }
+
+    op_index pop(iterator it) {
+        if (it == request_queue.end()) {
+            return NO_OP;
+        }
+        op_index io_op = it->second;
+        request_queue.erase(it);
+        return io_op;
+    }
+
+    public:
+        TreeQueue() {
+            nb_pushed = 0;
+        }
+
+        void push(op_index io_op, io_track track) {
+            request_queue[make_pair(track, nb_pushed)] = io_op;
+            nb_pushed++;
+        }
+
+        bool empty() {
+            return request_queue.empty();
+        }
+
+        op_index pop_nearest(io_track head) {
+            iterator above = find_at_or_above(head);
+            iterator below = find_at_or_below(head - 1);
+            if (above == request_queue.end()) {
+                return pop(below);
+            }
+            if (below == request_queue.end()) {
+                return pop(above);
+            }
+            io_track distance_above = above->first.first - head;
+            io_track distance_below = head - below->first.first;
+            if ( (distance_below < distance_above)
+                || ( (distance_below == distance_above) && (below->first.second < above->first.second) ) ) {
+                return pop(below);
+            }
+            return pop(above);
+        }
+
+        op_index pop_at_or_above(io_track from) {
+            return pop(find_at_or_above(from));
+        }
+
+        op_index pop_at_or_below(io_track from) {
+            return pop(find_at_or_below(from));
+        }
+
+        void contents(vector<op_index>& ops) {
+            for (iterator it = request_queue.begin(); it != request_queue.end(); it++) {
+                ops.push_back(it->second);
+            }
+        }
+};
+
+
+// Direction of a nearest-track search of the SIMD kernels
+enum SeekDirection { SEEK_NEAREST, SEEK_ABOVE, SEEK_BELOW };
+
+typedef int (*FirstClosestKernel)(const io_track* tracks, int n, io_track from, int direction);
+
+FirstClosestKernel first_closest_kernel(); // Best nearest-track search kernel for this CPU
+
+
+class SimdQueue: public RequestQueue {
+    // Two parallel vectors in order of arrival, like ScanQueue : the kernels read the packed tracks
+    vector<io_track> tracks;
+    vector<op_index> request_queue;
+    FirstClosestKernel first_closest;
+
+    op_index pop_closest(io_track from, int direction) {
+        int pos = first_closest(tracks.data(), tracks.size(), from, direction);
+        if (pos < 0) {
+            return NO_OP;
+        }
+        op_index next_io_op = request_queue[pos];
+        tracks.erase(tracks.begin() + pos);
+        request_queue.erase(request_queue.begin() + pos);
+        return next_io_op;
+    }
+
+    public:
+        SimdQueue(FirstClosestKernel first_closest_) {
+            first_closest = first_closest_;
+        }
+
+        void push(op_index io_op, io_track track) {
+            tracks.push_back(track);
+            request_queue.push_back(io_op);
+        }
+
+        bool empty() {
+            return request_queue.empty();
+        }
+
+        op_index pop_nearest(io_track head) {
+            return pop_closest(head, SEEK_NEAREST);
+        }
+
+        op_index pop_at_or_above(io_track from) {
+            return pop_closest(from, SEEK_ABOVE);
+        }
+
+        op_index pop_at_or_below(io_track from) {
+            return pop_closest(from, SEEK_BELOW);
+        }
+
+        void contents(vector<op_index>& ops) {
+            ops.insert(ops.end(), request_queue.begin(), request_queue.end());
+        }
+};
+
+
+class BitmapQueue: public RequestQueue {
+    // Hierarchical occupancy bitmap over the tracks. Level 0 has one bit per track, in words of 64 tracks. Each level
+    // above has one bit per non-empty word of the level below, up to a single word covering 2^42 tracks.
+    // The next occupied track above a track is found by going up until a word has a bit above the position, then down
+    // taking the lowest bit of each word (ctz) : at most 2 word operations per level, whatever the number of requests.
+    // Below is the same with the highest bits (clz). The track space is too large for flat arrays (2^40 tracks in the
+    // large-disk mode), so each level only stores its non-empty words, in a hash table.
+    // The requests of a track are kept in order of push : ties go to the earliest one, like the other backends.
+    static const int LEVELS = 7;
+    typedef pair<long long, op_index> Request; // (order of push, request)
+    unordered_map<uint64_t, uint64_t> levels[LEVELS]; // levels[l][i] : word i of level l, i.e. the bits of indexes 64i..64i+63
+    unordered_map<uint64_t, deque<Request> > requests; // requests of each occupied track
+    long long nb_pushed;
+
+    static const uint64_t NONE = UINT64_MAX;
+    static const uint64_t LAST_TRACK = ((uint64_t) 1 << (6 * LEVELS)) - 1;
+
+    uint64_t word(int level, uint64_t i) const {
+        unordered_map<uint64_t, uint64_t>::const_iterator it = levels[level].find(i);
+        return (it != levels[level].end()) ? it->second : 0;
+    }
+
+    // The first non-empty word of level found has bit bit : go down to the track, taking the lowest or highest bit
+    uint64_t descend(int level, uint64_t index, bool lowest) const {
+        while (level > 0) {
+            level--;
+            uint64_t bits = word(level, index);
+            index = index * 64 + (lowest ? __builtin_ctzll(bits) : 63 - __builtin_clzll(bits));
+        }
+        return index;
+    }
+
+    // Lowest occupied track >= from. NONE if there is none
+    uint64_t next_above(uint64_t from) const {
+        uint64_t index = from; // index at the current level
+        for (int level = 0; level < LEVELS; level++) {
+            uint64_t bits = word(level, index / 64) & (~0ULL << (index % 64));
+            if (bits != 0) {
+                return descend(level, (index / 64) * 64 + __builtin_ctzll(bits), true);
+            }
+            index = index / 64 + 1; // the words after this one, at the level above
+            if (index % 64 == 0 && level == LEVELS - 1) {
+                break;
+            }
+        }
+        return NONE;
+    }
+
+    // Highest occupied track <= from. NONE if there is none
+    uint64_t next_below(uint64_t from) const {
+        uint64_t index = from;
+        for (int level = 0; level < LEVELS; level++) {
+            uint64_t bits = word(level, index / 64) & (~0ULL >> (63 - index % 64));
+            if (bits != 0) {
+                return descend(level, (index / 64) * 64 + 63 - __builtin_clzll(bits), false);
+            }
+            if (index / 64 == 0) {
+                break;
+            }
+            index = index / 64 - 1; // the words before this one, at the level above
+        }
+        return NONE;
+    }
+
+    void set(uint64_t track) {
+        for (int level = 0; level < LEVELS; level++) {
+            uint64_t& bits = levels[level][track / 64];
+            bool was_empty = (bits == 0);
+            bits |= 1ULL << (track % 64);
+            if (!was_empty) {
+                return;
+            }
+            track /= 64;
+        }
+    }
+
+    void clear(uint64_t track) {
+        for (int level = 0; level < LEVELS; level++) {
+            unordered_map<uint64_t, uint64_t>::iterator it = levels[level].find(track / 64);
+            it->second &= ~(1ULL << (track % 64));
+            if (it->second != 0) {
+                return;
+            }
+            levels[level].erase(it);
+            track /= 64;
+        }
+    }
+
+    op_index pop_track(uint64_t track) {
+        if (track == NONE) {
+            return NO_OP;
+        }
+        unordered_map<uint64_t, deque<Request> >::iterator it = requests.find(track);
+        op_index io_op = it->second.front().second;
+        it->second.pop_front();
+        if (it->second.empty()) {
+            requests.erase(it);
+            clear(track);
+        }
+        return io_op;
+    }
+
+    static bool beyond(io_track from) {
+        return (from > 0) && ((uint64_t) from > LAST_TRACK);
+    }
+
+    // The tracks are never negative. Out of the bitmap, a search starts from its first or last track
+    static uint64_t clamp(io_track from) {
+        if (from < 0) {
+            return 0;
+        }
+        return ((uint64_t) from > LAST_TRACK) ? LAST_TRACK : (uint64_t) from;
+    }
+
+    public:
+        BitmapQueue() {
+            nb_pushed = 0;
+        }
+
+        void push(op_index io_op, io_track track) {
+            deque<Request>& on_track = requests[track];
+            if (on_track.empty()) {
+                set(track);
+            }
+            on_track.push_back(make_pair(nb_pushed, io_op));
+            nb_pushed++;
+        }
+
+        bool empty() {
+            return requests.empty();
+        }
+
+        op_index pop_nearest(io_track head) {
+            uint64_t above = beyond(head) ? NONE : next_above(clamp(head));
+            uint64_t below = (head > 0) ? next_below(clamp(head - 1)) : NONE;
+            if (above == NONE || below == NONE) {
+                return pop_track(above == NONE ? below : above);
+            }
+            io_track distance_above = (io_track) above - head;
+            io_track distance_below = head - (io_track) below;
+            if ( (distance_below < distance_above)
+                || ( (distance_below == distance_above) && (requests[below].front().first < requests[above].front().first) ) ) {
+                return pop_track(below);
+            }
+            return pop_track(above);
+        }
+
+        op_index pop_at_or_above(io_track from) {
+            return beyond(from) ? NO_OP : pop_track(next_above(clamp(from)));
+        }
+
+        op_index pop_at_or_below(io_track from) {
+            return (from >= 0) ? pop_track(next_below(clamp(from))) : NO_OP;
+        }
+
+        // In order of push
+        void contents(vector<op_index>& ops) {
+            vector<Request> all;
+            for (unordered_map<uint64_t, deque<Request> >::iterator it = requests.begin(); it != requests.end(); it++) {
+                all.insert(all.end(), it->second.begin(), it->second.end());
+            }
+            sort(all.begin(), all.end());
+            for (size_t i = 0; i < all.size(); i++) {
+                ops.push_back(all[i].second);
+            }
+        }
+};
+
+
+// Create a request queue given the backend letter of the -b flag
+RequestQueue* new_request_queue(char backend);
+
+
+//-------------------- STEP 3ter : Access time models --------------------
+// By default the head moves one track per time unit, and an IO operation is done as soon as the head is on its track.
+// A cost model (-M flag) gives instead the whole time to access an IO operation : seek, rotation and transfer.
+// The simulation then jumps from the issue of each IO operation straight to its completion (see cost_simulation_loop),
+// and SATF uses the model to choose the next IO operation.
+
+class CostModel {
+    public:
+        // Time to access the IO operation oid on track, with the head on track head at time now
+        virtual io_time access_time(io_track head, io_track track, int oid, io_time now) const = 0;
+        // Time of a seek of distance tracks. Never decreases with the distance, and never above access_time()
+        virtual io_time seek_time(io_track distance) const = 0;
+        virtual ~CostModel() {}
+};
+
+
+// The default model : one time unit per track, nothing else
+class LinearCost: public CostModel {
+    public:
+        io_time access_time(io_track head, io_track track, int /*oid*/, io_time /*now*/) const {
+            return abs(track - head);
+        }
+
+        io_time seek_time(io_track distance) const {
+            return distance;
+        }
+};
+
+
+// Seek curve of Ruemmler and Wilkes ("An introduction to disk drive modeling") : a short seek is mostly acceleration
+// and deceleration so it grows like the square root of the distance, a long one coasts at full speed so it grows
+// linearly beyond the knee, and both end with the settle time. The two parts meet at the knee.
+// Then the head waits for the sector to pass under it (the disk turns once every rotation time units), and transfers.
+// The traces have no sector : the angular position of an IO operation is derived from its oid.
+class SeekCurveCost: public CostModel {
+    double settle;
+    double sqrt_coef;
+    double knee;
+    double linear_coef;
+    double linear_base; // so that the linear part meets the square root part at the knee
+    int rotation; // 0 : no rotational delay
+    int transfer;
+
+    public:
+        SeekCurveCost(double settle_, double sqrt_coef_, double knee_, double linear_coef_, int rotation_, int transfer_) {
+            settle = settle_;
+            sqrt_coef = sqrt_coef_;
+            knee = knee_;
+            linear_coef = linear_coef_;
+            rotation = rotation_;
+            transfer = transfer_;
+            linear_base = settle + sqrt_coef * sqrt(knee) - linear_coef * knee;
+        }
+
+        io_time seek_time(io_track distance) const {
+            if (distance == 0) {
+                return 0;
+            }
+            double time = (distance < knee) ? settle + sqrt_coef * sqrt((double) distance) : linear_base + linear_coef * distance;
+            return (io_time) ceil(time);
+        }
+
+        io_time access_time(io_track head, io_track track, int oid, io_time now) const {
+            io_time seek = seek_time(abs(track - head));
+            io_time rotational = 0;
+            if (rotation > 0) {
+                int sector = (int) (((uint32_t) oid * 2654435761u) % (uint32_t) rotation);
+                rotational = ((sector - (now + seek)) % rotation + rotation) % rotation;
+            }
+            return seek + rotational + transfer;
+        }
+};
+
+
+//-------------------- STEP 4 : Create the different Scheduler Algorithms --------------------
+
+class FIFO final: public Scheduler {
+    deque<op_index> request_queue;
+
+    public :
+        FIFO(const IO_pool* io_ops_):Scheduler(io_ops_) {}
+
+    op_index strategy() {
+        if (request_queue.empty()) {
+                return NO_OP;
+        } else {
+            op_index next_io_op = request_queue.front();
+            request_queue.pop_front();
+            curr_io_op = next_io_op;
+            return next_io_op;
+        }
+    }
+
+    // Move head toward a target track
+    // Unlike the other schedulers, if the head is already on the track it moves away and comes back
+    void move_head() {
+        io_track track = io_ops->track[curr_io_op];
+        if ( head < track ) {
+            head++;
+        } else {
+            head--;
+        }
+        if (head == track) {
+            isCompleted = true;
+        }
+    };
+
+    void add_request(op_index io_op) {
+        request_queue.push_back(io_op);
+    }
+
+    bool hasRequest() {
+        return !(request_queue.empty());
+    }
+
+    void queue_contents(vector<op_index>& ops, int queue) {
+        if (queue == 0) {
+            ops.insert(ops.end(), request_queue.begin(), request_queue.end());
+        }
+    }
+
+
+};
+
+
+class SSTF final: public Scheduler {
+    RequestQueue* request_queue;
+
+    public :
+        SSTF(const IO_pool* io_ops_, char backend):Scheduler(io_ops_) {
+            request_queue = new_request_queue(backend);
+        }
+
+        ~SSTF() {
+            delete request_queue;
+        }
+
+    op_index strategy() {
+        if (request_queue->empty()) {
+                return NO_OP;
+        } else {
+            // We remove the shortest seek time request from the request queue and return it
+            op_index next_io_op = request_queue->pop_nearest(head);
+            curr_io_op = next_io_op;
+            return next_io_op;
+        }
+    }
+
+    void add_request(op_index io_op) {
+        request_queue->push(io_op, io_ops->track[io_op]);
+    }
+
+    bool hasRequest() {
+        return !(request_queue->empty());
+    }
+
+    void queue_contents(vector<op_index>& ops, int queue) {
+        if (queue == 0) {
+            request_queue->contents(ops);
+        }
+    }
+
+
+};
+
+
+class LOOK final: public Scheduler {
+    RequestQueue* request_queue;
+    bool going_forward; // This bool decides if we're going forward or backward (direction of the look)
+
+    public :
+        LOOK(const IO_pool* io_ops_, char backend, bool forward = true):Scheduler(io_ops_) {
+            going_forward = forward; // We assume that we start with the head at 0 so we move forward
+            request_queue = new_request_queue(backend);
+        }
+
+        ~LOOK() {
+            delete request_queue;
+        }
+
+    // We must pick the closest request in our direction
+    // It's just like SSTF except we filter out the request which are not in our direction
+    op_index strategy() {
+        if (request_queue->empty()) {
+                return NO_OP;
+        } else {
+            op_index next_io_op = going_forward ? request_queue->pop_at_or_above(head) : request_queue->pop_at_or_below(head);
+
+            // We either found a request or we didn't. For the latter, we have to reverse the direction and do the same
+            if (next_io_op == NO_OP) {
+                going_forward = !going_forward;
+                next_io_op = going_forward ? request_queue->pop_at_or_above(head) : request_queue->pop_at_or_below(head);
+            }
+
+            curr_io_op = next_io_op;
+            return next_io_op;
+        }
+    }
+
+    void add_request(op_index io_op) {
+        request_queue->push(io_op, io_ops->track[io_op]);
+    }
+
+    bool hasRequest() {
+        return !(request_queue->empty());
+    }
+
+    void queue_contents(vector<op_index>& ops, int queue) {
+        if (queue == 0) {
+            request_queue->contents(ops);
+        }
+    }
+
+    int save_state() {
+        return going_forward;
+    }
+
+    void restore(const vector<op_index>* queues, int state) {
+        Scheduler::restore(queues, state);
+        going_forward = state;
+    }
+
+
+};
+
+
+class CLOOK final: public Scheduler {
+    // Same as LOOK, we just make minor changes in the strategy
+    RequestQueue* request_queue;
+
+    public :
+        CLOOK(const IO_pool* io_ops_, char backend):Scheduler(io_ops_) {
+            request_queue = new_request_queue(backend);
+        }
+
+        ~CLOOK() {
+            delete request_queue;
+        }
+
+    // We must pick the closest request in our direction which is always forward
+    op_index strategy() {
+        if (request_queue->empty()) {
+                return NO_OP;
+        } else {
+            op_index next_io_op = request_queue->pop_at_or_above(head);
+
+            // We either found a request or we didn't. For the latter, we have to circle back to track 0 and look again
+            // We don't set head = 0 because it is logically false, the scheduler's head doesn't teleport to 0 like that
+            if (next_io_op == NO_OP) {
+                next_io_op = request_queue->pop_at_or_above(0);
+            }
+
+            curr_io_op = next_io_op;
+            return next_io_op;
+        }
+    }
+
+    void add_request(op_index io_op) {
+        request_queue->push(io_op, io_ops->track[io_op]);
+    }
+
+    bool hasRequest() {
+        return !(request_queue->empty());
+    }
+
+    void queue_contents(vector<op_index>& ops, int queue) {
+        if (queue == 0) {
+            request_queue->contents(ops);
+        }
+    }
+
+
+};
+
+
+class FLOOK final: public Scheduler {
+    // Create POINTERS to add_queue and active_queue
+    RequestQueue* add_queue;
+    RequestQueue* active_queue;
+    bool going_forward; // This bool decides if we're going forward or backward (direction of the look)
+    int batch; // swap after this many dispatches from the active queue, even if it is not empty (0 : only when empty)
+    int nb_served; // dispatches from the active queue since the last swap
+
+    public :
+        FLOOK(const IO_pool* io_ops_, char backend, bool forward = true, int batch_ = 0):Scheduler(io_ops_) {
+            going_forward = forward; // We assume that we start with the head at 0 so we move forward
+            batch = batch_;
+            nb_served = 0;
+            add_queue = new_request_queue(backend);
+            active_queue = new_request_queue(backend);
+        }
+
+        ~FLOOK() {
+            delete add_queue;
+            delete active_queue;
+        }
+    // It's just like LOOK, just need to swap the queue when the active_queue is empty..
+    op_index strategy() {
+        if (add_queue->empty() && active_queue->empty()) {
+                return NO_OP;
+        } else {
+
+            // First we check if active queue is empty or not. If empty, we swap
+            // With a batch, we also swap once the batch is served : the rest of the active queue waits for the next turn
+            if (active_queue->empty() || (batch > 0 && nb_served >= batch && !add_queue->empty())) {
+                swap(active_queue, add_queue);
+                nb_swaps++;
+                nb_served = 0;
+            }
+            nb_served++;
+
+            // Now we know for sure that the active queue is NOT empty
+            // If it is still empty, it means that the add_queue was also empty
+            // But if that was the case, we would have returned NO_OP previously
+
+            // Now we do just like LOOK but with the active_queue. It's the same code literally
+            op_index next_io_op = going_forward ? active_queue->pop_at_or_above(head) : active_queue->pop_at_or_below(head);
+
+            // We either found a request or we didn't. For the latter, we have to reverse the direction and do the same as before
+            if (next_io_op == NO_OP) {
+                going_forward = !going_forward; // Here we make a change
+                next_io_op = going_forward ? active_queue->pop_at_or_above(head) : active_queue->pop_at_or_below(head);
+            }
+
+            curr_io_op = next_io_op;
+            return next_io_op;
+        }
+    }
+
+    void add_request(op_index io_op) {
+        add_queue->push(io_op, io_ops->track[io_op]);
+    }
+
+    bool hasRequest() {
+        // If the active queue is empty, we would swap so we need to check the add_queue aswell
+        return !( active_queue->empty() && add_queue->empty() );
+    }
+
+    void queue_contents(vector<op_index>& ops, int queue) {
+        if (queue == 0) {
+            active_queue->contents(ops);
+        } else {
+            add_queue->contents(ops);
+        }
+    }
+
+    int save_state() {
+        return going_forward | (nb_served << 1);
+    }
+
+    void restore(const vector<op_index>* queues, int state) {
+        nb_served = state >> 1;
+        state &= 1;
+        for (size_t i = 0; i < queues[0].size(); i++) {
+            active_queue->push(queues[0][i], io_ops->track[queues[0][i]]);
+        }
+        for (size_t i = 0; i < queues[1].size(); i++) {
+            add_queue->push(queues[1][i], io_ops->track[queues[1][i]]);
+        }
+        going_forward = state;
+    }
+
+
+};
+
+
+
+
+class DEADLINE final: public Scheduler {
+    // Modeled on mq-deadline. The requests are in two queues at once : sorted by track, and by arrival (FIFO).
+    // They are dispatched in batches of up to fifo_batch requests going up in track order, like CLOOK.
+    // A new batch starts from the oldest request if its deadline (arrival + expire) has passed or if there is no
+    // request above the head, so no request waits much more than expire time units.
+    // A small expire behaves like FIFO, a large one like an elevator : the trade-off between seek and tail wait time.
+    map< pair<io_track, long long>, op_index > sort_queue; // requests by (track, order of arrival)
+    map< long long, op_index > fifo_queue; // requests by order of arrival
+    typedef map< pair<io_track, long long>, op_index >::iterator sort_iterator;
+    long long nb_added;
+    int expire; // -1 : at least MIN_EXPIRE, and AUTO_EXPIRE_SEEKS seeks across the tracks requested so far
+    int fifo_batch;
+    int batching; // requests dispatched in the current batch
+    io_track min_track; // tracks requested so far, -1 before the first request
+    io_track max_track;
+    LinearCost linear;
+    const CostModel* cost_model;
+
+    public :
+        // With an expire below the time of a sweep over the pending requests, every batch starts with the oldest one and
+        // a long seek : DEADLINE thrashes like FIFO. The default expire grows with the disk to stay above a sweep
+        static const int MIN_EXPIRE = 500;
+        static const int AUTO_EXPIRE_SEEKS = 4;
+
+        DEADLINE(const IO_pool* io_ops_, int expire_, int fifo_batch_, const CostModel* cost_model_ = NULL)
+                :Scheduler(io_ops_) {
+            nb_added = 0;
+            expire = expire_;
+            fifo_batch = fifo_batch_;
+            batching = 0;
+            min_track = -1;
+            max_track = -1;
+            cost_model = (cost_model_ != NULL) ? cost_model_ : &linear;
+        }
+
+    io_time expire_time() {
+        if (expire >= 0) {
+            return expire;
+        }
+        return max(AUTO_EXPIRE_SEEKS * cost_model->seek_time(max_track - min_track), (io_time) MIN_EXPIRE);
+    }
+
+    op_index strategy() {
+        if (fifo_queue.empty()) {
+                return NO_OP;
+        }
+        sort_iterator next = sort_queue.lower_bound(make_pair(head, LLONG_MIN));
+        if (next == sort_queue.end() || batching >= fifo_batch) {
+            // Start a new batch, from the oldest request if it expired
+            batching = 0;
+            op_index oldest = fifo_queue.begin()->second;
+            if (next == sort_queue.end() || io_ops->arrival_time[oldest] + expire_time() <= clock) {
+                next = sort_queue.find(make_pair(io_ops->track[oldest], fifo_queue.begin()->first));
+            }
+        }
+        batching++;
+        op_index next_io_op = next->second;
+        fifo_queue.erase(next->first.second);
+        sort_queue.erase(next);
+        curr_io_op = next_io_op;
+        return next_io_op;
+    }
+
+    void add_request(op_index io_op) {
+        io_track track = io_ops->track[io_op];
+        sort_queue[make_pair(track, nb_added)] = io_op;
+        fifo_queue[nb_added] = io_op;
+        nb_added++;
+        min_track = (min_track < 0) ? track : min(min_track, track);
+        max_track = max(max_track, track);
+    }
+
+    bool hasRequest() {
+        return !(fifo_queue.empty());
+    }
+
+    void queue_contents(vector<op_index>& ops, int queue) {
+        if (queue == 0) {
+            for (sort_iterator it = sort_queue.begin(); it != sort_queue.end(); it++) {
+                ops.push_back(it->second);
+            }
+        }
+    }
+
+    int save_state() {
+        return batching;
+    }
+
+    void restore(const vector<op_index>* queues, int state) {
+        Scheduler::restore(queues, state);
+        batching = state;
+    }
+
+    // min_track, max_track
+    void save_extra_state(vector<int64_t>& extra) {
+        extra.push_back(min_track);
+        extra.push_back(max_track);
+    }
+
+    void restore_extra_state(const vector<int64_t>& extra) {
+        if (extra.size() == 2) {
+            min_track = extra[0];
+            max_track = extra[1];
+        }
+    }
+
+
+};
+
+
+class SATF final: public Scheduler {
+    // Shortest access time first : the request with the lowest access time given by the cost model, seek and rotation.
+    // The requests are sorted by track. The search walks away from the head in both directions, and stops in a
+    // direction as soon as the seek time alone is above the best access time found : it only looks at the nearby tracks.
+    // With the linear model, it is SSTF.
+    map< pair<io_track, long long>, op_index > request_queue; // requests by (track, order of arrival)
+    typedef map< pair<io_track, long long>, op_index >::iterator iterator;
+    long long nb_added;
+    LinearCost linear;
+    const CostModel* cost_model;
+
+    public :
+        SATF(const IO_pool* io_ops_, const CostModel* cost_model_):Scheduler(io_ops_) {
+            nb_added = 0;
+            cost_model = (cost_model_ != NULL) ? cost_model_ : &linear;
+        }
+
+    op_index strategy() {
+        if (request_queue.empty()) {
+                return NO_OP;
+        }
+        iterator best = request_queue.end();
+        io_time best_time = 0;
+        iterator above = request_queue.lower_bound(make_pair(head, LLONG_MIN));
+        for (iterator it = above; it != request_queue.end(); it++) {
+            if ( !consider(it, best, best_time) ) {
+                break;
+            }
+        }
+        for (iterator it = above; it != request_queue.begin(); ) {
+            it--;
+            if ( !consider(it, best, best_time) ) {
+                break;
+            }
+        }
+        op_index next_io_op = best->second;
+        request_queue.erase(best);
+        curr_io_op = next_io_op;
+        return next_io_op;
+    }
+
+    // Keep the request of it if it is better than best. Ties go to the request that arrived first
+    // False if no request further away from the head can be better
+    bool consider(iterator it, iterator& best, io_time& best_time) {
+        io_track distance = abs(it->first.first - head);
+        if (best != request_queue.end() && cost_model->seek_time(distance) > best_time) {
+            return false;
+        }
+        op_index io_op = it->second;
+        io_time time = cost_model->access_time(head, it->first.first, io_ops->oid[io_op], clock);
+        if ( best == request_queue.end() || time < best_time
+            || (time == best_time && it->first.second < best->first.second) ) {
+            best = it;
+            best_time = time;
+        }
+        return true;
+    }
+
+    void add_request(op_index io_op) {
+        request_queue[make_pair(io_ops->track[io_op], nb_added)] = io_op;
+        nb_added++;
+    }
+
+    bool hasRequest() {
+        return !(request_queue.empty());
+    }
+
+    void queue_contents(vector<op_index>& ops, int queue) {
+        if (queue == 0) {
+            for (iterator it = request_queue.begin(); it != request_queue.end(); it++) {
+                ops.push_back(it->second);
+            }
+        }
+    }
+
+
+};
+
+
+class FAIRSHARE final: public Scheduler {
+    // Fair share of the disk time between the streams of the trace (4th column of the input), modeled on BFQ.
+    // Each stream has its own request queue and a weight. The disk serves one stream at a time, for a slice of up to
+    // budget time units of service, nearest request first inside the stream to keep its seek locality. The service of
+    // a request is its access time given by the cost model (the seek distance with the linear model), at least 1.
+    // When the slice is over or the stream has no more requests, the backlogged stream with the smallest virtual time
+    // gets the disk. The virtual time of a stream grows by its service divided by its weight, so the backlogged
+    // streams get shares of the disk time proportional to their weights, whatever the number of requests each one
+    // submits : a sequential scanner can't starve the others. A stream that becomes backlogged again starts from the
+    // virtual time of the last stream selected, so it can't save up credit while it is idle.
+    // Unlike BFQ, the disk never idles waiting for the next request of the stream in service. The budget must be
+    // well above a seek across the disk, or most of each slice is spent moving the head from one stream to the other.
+    // By default it is the time of AUTO_BUDGET_SEEKS such seeks, across the tracks requested so far : a switch costs
+    // at most two of them (to the stream and back), and a longer slice only delays the other streams.
+    static const int64_t WEIGHT_SCALE = 1000; // the virtual times are integers, in 1/WEIGHT_SCALE of a time unit
+    static const int AUTO_BUDGET_SEEKS = 2;
+
+    struct Stream {
+        RequestQueue* queue;
+        int weight;
+        int64_t virtual_time; // service received * WEIGHT_SCALE / weight
+    };
+    map<int, Stream> streams; // by stream id
+    char backend;
+    vector<int> weights; // weight of each stream id, 1 beyond the end
+    io_time budget; // 0 : AUTO_BUDGET_SEEKS seeks across the tracks requested so far
+    io_track min_track; // tracks requested so far, -1 before the first request
+    io_track max_track;
+    LinearCost linear;
+    const CostModel* cost_model;
+    int active; // stream in service, -1 if none
+    io_time used; // service given to the active stream in its slice
+    int64_t virtual_clock; // virtual time of the last stream selected
+    int nb_pending;
+
+    Stream& stream(int id) {
+        map<int, Stream>::iterator it = streams.find(id);
+        if (it == streams.end()) {
+            Stream created;
+            created.queue = new_request_queue(backend);
+            created.weight = (id < (int) weights.size()) ? weights[id] : 1;
+            created.virtual_time = virtual_clock;
+            it = streams.insert(make_pair(id, created)).first;
+        }
+        return it->second;
+    }
+
+    // The backlogged stream with the smallest virtual time gets a new slice. Ties go to the smallest id
+    void select() {
+        active = -1;
+        for (map<int, Stream>::iterator it = streams.begin(); it != streams.end(); it++) {
+            if ( !it->second.queue->empty() && (active < 0 || it->second.virtual_time < streams[active].virtual_time) ) {
+                active = it->first;
+            }
+        }
+        used = 0;
+        virtual_clock = streams[active].virtual_time;
+    }
+
+    public :
+        FAIRSHARE(const IO_pool* io_ops_, char backend_, io_time budget_, const vector<int>& weights_,
+                  const CostModel* cost_model_):Scheduler(io_ops_) {
+            backend = backend_;
+            budget = budget_;
+            weights = weights_;
+            cost_model = (cost_model_ != NULL) ? cost_model_ : &linear;
+            active = -1;
+            used = 0;
+            virtual_clock = 0;
+            nb_pending = 0;
+            min_track = -1;
+            max_track = -1;
+        }
+
+        ~FAIRSHARE() {
+            for (map<int, Stream>::iterator it = streams.begin(); it != streams.end(); it++) {
+                delete it->second.queue;
+            }
+        }
+
+    io_time slice_budget() {
+        if (budget > 0) {
+            return budget;
+        }
+        return max(AUTO_BUDGET_SEEKS * cost_model->seek_time(max_track - min_track), (io_time) 1);
+    }
+
+    op_index strategy() {
+        if (nb_pending == 0) {
+                return NO_OP;
+        }
+        io_time slice = slice_budget();
+        if (active < 0 || used >= slice || streams[active].queue->empty()) {
+            select();
+        }
+        Stream& served = streams[active];
+        op_index next_io_op = served.queue->pop_nearest(head);
+        io_track track = io_ops->track[next_io_op];
+        io_time service = max(cost_model->access_time(head, track, io_ops->oid[next_io_op], clock), (io_time) 1);
+        // A slice is charged at most its budget, even if its last request took longer
+        served.virtual_time += (int64_t) min(service, slice - used) * WEIGHT_SCALE / served.weight;
+        used += service;
+        nb_pending--;
+        curr_io_op = next_io_op;
+        return next_io_op;
+    }
+
+    void add_request(op_index io_op) {
+        int id = io_ops->stream_of(io_op);
+        Stream& target = stream(id);
+        if (target.queue->empty() && id != active) {
+            target.virtual_time = max(target.virtual_time, virtual_clock);
+        }
+        io_track track = io_ops->track[io_op];
+        target.queue->push(io_op, track);
+        min_track = (min_track < 0) ? track : min(min_track, track);
+        max_track = max(max_track, track);
+        nb_pending++;
+    }
+
+    bool hasRequest() {
+        return nb_pending > 0;
+    }
+
+    void queue_contents(vector<op_index>& ops, int queue) {
+        if (queue == 0) {
+            for (map<int, Stream>::iterator it = streams.begin(); it != streams.end(); it++) {
+                it->second.queue->contents(ops);
+            }
+        }
+    }
+
+    int save_state() {
+        return active;
+    }
+
+    void restore(const vector<op_index>* queues, int state) {
+        Scheduler::restore(queues, state);
+        active = state;
+    }
+
+    // used, virtual_clock, min_track, max_track, then (id, virtual time) of each stream
+    void save_extra_state(vector<int64_t>& extra) {
+        extra.push_back(used);
+        extra.push_back(virtual_clock);
+        extra.push_back(min_track);
+        extra.push_back(max_track);
+        for (map<int, Stream>::iterator it = streams.begin(); it != streams.end(); it++) {
+            extra.push_back(it->first);
+            extra.push_back(it->second.virtual_time);
+        }
+    }
+
+    void restore_extra_state(const vector<int64_t>& extra) {
+        if (extra.size() < 4) {
+            return;
+        }
+        used = extra[0];
+        virtual_clock = extra[1];
+        min_track = extra[2];
+        max_track = extra[3];
+        for (size_t i = 4; i + 1 < extra.size(); i += 2) {
+            stream((int) extra[i]).virtual_time = extra[i + 1];
+        }
+    }
+
+
+};
+
+
+// Tunables of the schedulers (-E, -M and -K flags)
+struct SchedulerConfig {
+    int expire; // DEADLINE : a request must be served expire time units after its arrival (-1 : from the tracks)
+    int fifo_batch; // DEADLINE : number of requests dispatched in track order before the deadlines are checked
+    const CostModel* cost_model; // SATF, and the simulation. NULL : the linear model
+    bool look_forward; // LOOK and FLOOK : initial direction of the head
+    int flook_batch; // FLOOK : dispatches from the active queue before a swap (0 : swap when it is empty)
+    io_time fair_budget; // FAIRSHARE : service of a stream before the next one may get the disk (0 : from the tracks)
+    vector<int> stream_weights; // FAIRSHARE : weight of each stream id (1 for the ids beyond the end)
+
+    SchedulerConfig() {
+        expire = -1;
+        fifo_batch = 16;
+        cost_model = NULL;
+        look_forward = true;
+        flook_batch = 0;
+        fair_budget = 0;
+    }
+};
+
+// Create a scheduler given the letter of the -s flag. NULL if the letter is unknown
+Scheduler* new_scheduler(char algo, const IO_pool* io_ops, char backend, const SchedulerConfig& config = SchedulerConfig());
+
+
+//-------------------- STEP 4bis : Trace the events of the simulation --------------------
+// The -v, -q and -f flags record what the scheduler did at each step :
+//   -v : every IO operation added to the request queue, issued to the disk and completed
+//   -q : the content of the request queue at each dispatch
+//   -f : the swaps of the FLOOK queues, and the content of both queues at each dispatch
+// The events are stored as binary records in a ring buffer allocated once before the run, so recording an event is
+// only a few stores. They are formatted at the end of the run, or dumped as they are to a file (-D flag).
+// When the ring is full the oldest records are overwritten : the trace keeps the last events before the end.
+// Without any of these flags the simulation loops are instantiated without the tracing code (see Simulator).
+
+enum TraceType { TRACE_ADD, TRACE_ISSUE, TRACE_COMPLETE, TRACE_QUEUE, TRACE_SWAP };
+
+struct TraceRecord {
+    io_time time;
+    int oid;
+    io_track track;
+    io_time value; // issue : head, complete : turnaround, queue : distance to the head
+    uint8_t type; // TraceType
+    uint8_t queue; // queue of a TRACE_QUEUE record : 0 for the request queue or active_queue, 1 for the add_queue
+};
+
+class Tracer {
+    vector<TraceRecord> ring;
+    long long nb_records; // total number of records, the ring holds the last ones
+
+    public:
+        bool verbose; // -v
+        bool queues; // -q
+        bool flook_queues; // -f
+
+        Tracer(size_t capacity, bool verbose_, bool queues_, bool flook_queues_) {
+            ring.resize(capacity);
+            nb_records = 0;
+            verbose = verbose_;
+            queues = queues_;
+            flook_queues = flook_queues_;
+        }
+
+        void record(uint8_t type, io_time time, int oid, io_track track, io_time value, uint8_t queue = 0) {
+            TraceRecord& record = ring[nb_records % ring.size()];
+            record.time = time;
+            record.oid = oid;
+            record.track = track;
+            record.value = value;
+            record.type = type;
+            record.queue = queue;
+            nb_records++;
+        }
+
+        // Call f on each record still in the ring, from the oldest to the newest
+        template <class F>
+        void for_each(F f) {
+            long long first = (nb_records > (long long) ring.size()) ? nb_records - ring.size() : 0;
+            for (long long i = first; i < nb_records; i++) {
+                f(ring[i % ring.size()]);
+            }
+        }
+
+        void print(FILE* file) {
+            if (nb_records > (long long) ring.size()) {
+                fprintf(file, "TRACE (last %zu of %lld events)\n", ring.size(), nb_records);
+            } else {
+                fprintf(file, "TRACE\n");
+            }
+            bool in_queue = false; // the queue records of a dispatch are printed on one line
+            int queue = 0;
+            for_each([&](const TraceRecord& record) {
+                if (in_queue && (record.type != TRACE_QUEUE || record.queue != queue)) {
+                    fprintf(file, " )\n");
+                    in_queue = false;
+                }
+                switch (record.type) {
+                    case TRACE_ADD :
+                        fprintf(file, "%lld: %5d add %lld\n", (long long) record.time, record.oid, (long long) record.track);
+                        break;
+                    case TRACE_ISSUE :
+                        fprintf(file, "%lld: %5d issue %lld %lld\n", (long long) record.time, record.oid, (long long) record.track,
+                                (long long) record.value);
+                        break;
+                    case TRACE_COMPLETE :
+                        fprintf(file, "%lld: %5d finish %lld\n", (long long) record.time, record.oid, (long long) record.value);
+                        break;
+                    case TRACE_SWAP :
+                        fprintf(file, "%lld: swap queues\n", (long long) record.time);
+                        break;
+                    case TRACE_QUEUE :
+                        if (!in_queue) {
+                            fprintf(file, "  %s (", record.queue == 0 ? "Q" : "AQ");
+                            in_queue = true;
+                            queue = record.queue;
+                        }
+                        fprintf(file, " %d:%lld:%lld", record.oid, (long long) record.track, (long long) record.value);
+                        break;
+                }
+            });
+            if (in_queue) {
+                fprintf(file, " )\n");
+            }
+        }
+
+        bool dump(const char* path) {
+            FILE* file = fopen(path, "wb");
+            if (file == NULL) {
+                return false;
+            }
+            for_each([&](const TraceRecord& record) {
+                fwrite(&record, sizeof(record), 1, file);
+            });
+            return fclose(file) == 0;
+        }
+};
+
+
+//-------------------- STEP 4ter : Latency histograms --------------------
+// Fixed-memory histogram with logarithmic buckets (like HdrHistogram) : values below 128 have their own bucket, and
+// every power of 2 above is split in 64 buckets, so a percentile is known within 1.6% whatever the range of the values.
+// Recording a value is a clz and an increment, and the memory doesn't depend on the number of IO operations :
+// the percentiles work in streaming mode too, where the IO operations are freed as soon as they complete.
+
+class Histogram {
+    static const int SUB_BITS = 7;
+    static const int64_t SUB_COUNT = 1 << SUB_BITS;
+    vector<uint64_t> counts;
+    uint64_t total;
+    int64_t max_value;
+    int64_t value_sum;
+
+    static int bucket_of(int64_t value) {
+        if (value < SUB_COUNT) {
+            return (int) value;
+        }
+        int exponent = 63 - __builtin_clzll((uint64_t) value);
+        int64_t mantissa = value >> (exponent - SUB_BITS + 1); // in [SUB_COUNT / 2, SUB_COUNT)
+        return (exponent - SUB_BITS + 2) * (SUB_COUNT / 2) + (int) (mantissa - SUB_COUNT / 2);
+    }
+
+    // Smallest value of a bucket
+    static int64_t lowest_of(int bucket) {
+        if (bucket < SUB_COUNT) {
+            return bucket;
+        }
+        int exponent = bucket / (SUB_COUNT / 2) + SUB_BITS - 2;
+        int64_t mantissa = bucket % (SUB_COUNT / 2) + SUB_COUNT / 2;
+        return mantissa << (exponent - SUB_BITS + 1);
+    }
+
+    public:
+        Histogram() {
+            counts.resize(bucket_of(INT64_MAX) + 1, 0);
+            total = 0;
+            max_value = 0;
+            value_sum = 0;
+        }
+
+        void record(int64_t value) {
+            if (value < 0) {
+                value = 0;
+            }
+            counts[bucket_of(value)]++;
+            total++;
+            max_value = max(max_value, value);
+            value_sum += value;
+        }
+
+        void add(const Histogram& other) {
+            for (size_t bucket = 0; bucket < counts.size(); bucket++) {
+                counts[bucket] += other.counts[bucket];
+            }
+            total += other.total;
+            max_value = max(max_value, other.max_value);
+            value_sum += other.value_sum;
+        }
+
+        // Sum of the values recorded (exact, unlike the buckets)
+        int64_t sum() const {
+            return value_sum;
+        }
+
+        // Highest value equivalent to the value at this percentile (0 to 100)
+        int64_t percentile(double p) const {
+            uint64_t rank = (uint64_t) (p / 100.0 * total + 0.5);
+            rank = max(rank, (uint64_t) 1);
+            uint64_t seen = 0;
+            for (size_t bucket = 0; bucket < counts.size(); bucket++) {
+                seen += counts[bucket];
+                if (seen >= rank) {
+                    int64_t highest = (bucket + 1 < counts.size()) ? lowest_of(bucket + 1) - 1 : INT64_MAX;
+                    return min(highest, max_value);
+                }
+            }
+            return max_value;
+        }
+
+        void print_percentiles(FILE* file, const char* name) const {
+            fprintf(file, "PCT %s: %lld %lld %lld %lld\n", name, (long long) percentile(50), (long long) percentile(90),
+                    (long long) percentile(99), (long long) percentile(99.9));
+        }
+
+        // Raw counts, for the snapshot files
+        bool write(FILE* file) const {
+            size_t nb_buckets = counts.size();
+            return fwrite(&nb_buckets, sizeof(nb_buckets), 1, file) == 1
+                && fwrite(counts.data(), sizeof(uint64_t), nb_buckets, file) == nb_buckets
+                && fwrite(&total, sizeof(total), 1, file) == 1 && fwrite(&max_value, sizeof(max_value), 1, file) == 1
+                && fwrite(&value_sum, sizeof(value_sum), 1, file) == 1;
+        }
+
+        bool read(FILE* file) {
+            size_t nb_buckets = 0;
+            return fread(&nb_buckets, sizeof(nb_buckets), 1, file) == 1 && nb_buckets == counts.size()
+                && fread(counts.data(), sizeof(uint64_t), nb_buckets, file) == nb_buckets
+                && fread(&total, sizeof(total), 1, file) == 1 && fread(&max_value, sizeof(max_value), 1, file) == 1
+                && fread(&value_sum, sizeof(value_sum), 1, file) == 1;
+        }
+
+        // One line per non-empty bucket : metric,lowest,highest,count
+        void dump_csv(FILE* file, const char* name) {
+            for (size_t bucket = 0; bucket < counts.size(); bucket++) {
+                if (counts[bucket] > 0) {
+                    int64_t highest = (bucket + 1 < counts.size()) ? lowest_of(bucket + 1) - 1 : INT64_MAX;
+                    fprintf(file, "%s,%lld,%lld,%llu\n", name, (long long) lowest_of(bucket), (long long) highest,
+                            (unsigned long long) counts[bucket]);
+                }
+            }
+        }
+};
+
+
+//-------------------- STEP 4quater : Performance counters of the phases of a run --------------------
+// With the -I flag the run is split in phases : loading the trace, the simulation loop, the dispatch decisions
+// (the strategy() calls, inside the simulation loop) and printing the results. Each phase counts its time and, when
+// the kernel lets us open them with perf_event_open (see /proc/sys/kernel/perf_event_paranoid), the CPU cycles,
+// instructions, cache misses and branch misses spent in user space. Otherwise only the time is counted (clock_gettime).
+// The counters are read when a phase starts and when it stops, so a dispatch reads them around every strategy() call :
+// the run gets slower with -I, but the reads themselves run in the kernel and are not counted.
+
+enum Phase { PHASE_LOAD, PHASE_SIMULATION, PHASE_DISPATCH, PHASE_OUTPUT, NB_PHASES };
+enum Counter { COUNTER_CYCLES, COUNTER_INSTRUCTIONS, COUNTER_CACHE_MISSES, COUNTER_BRANCH_MISSES, NB_COUNTERS };
+
+class PhaseCounters {
+    int fds[NB_COUNTERS]; // perf_event file descriptors, -1 if not available. fds[0] leads the group of the others
+    int positions[NB_COUNTERS]; // position of each counter in a read of the group
+    int nb_opened;
+    // values[0] is the time in ns, then the counters
+    int64_t totals[NB_PHASES][NB_COUNTERS + 1];
+    int64_t started[NB_PHASES][NB_COUNTERS + 1];
+    int64_t nb_runs[NB_PHASES];
+
+    void read_values(int64_t* values);
+
+    public:
+        PhaseCounters(); // Opens the hardware counters if the kernel allows it. Defined in libiosched.cpp
+        ~PhaseCounters();
+
+        bool hardware() const {
+            return nb_opened > 0;
+        }
+
+        void start(Phase phase) {
+            read_values(started[phase]);
+        }
+
+        void stop(Phase phase) {
+            int64_t values[NB_COUNTERS + 1];
+            read_values(values);
+            for (int v = 0; v <= NB_COUNTERS; v++) {
+                totals[phase][v] += values[v] - started[phase][v];
+            }
+            nb_runs[phase]++;
+        }
+
+        // One PHASE line per phase that ran, plus "move" : the simulation loop without the dispatches (head movements,
+        // arrivals and completions). The time is also given per IO operation, or per call for the dispatches
+        void print(FILE* file, int nb_io_ops);
+};
+
+
+//-------------------- STEP 5 : Create the simulator --------------------
+
+// Statistics of one stream of the trace (4th column of the input), accumulated as its IO operations complete
+struct StreamSummary {
+    int nb_io_ops;
+    io_time last_end_time;
+    double sum_turnaround;
+    double sum_wait_time;
+    io_time max_wait_time;
+    Histogram wait_histogram;
+
+    StreamSummary() {
+        nb_io_ops = 0;
+        last_end_time = 0;
+        sum_turnaround = 0;
+        sum_wait_time = 0;
+        max_wait_time = 0;
+    }
+
+    // Merge the statistics of the same stream on another device (-d flag)
+    void add(const StreamSummary& other) {
+        nb_io_ops += other.nb_io_ops;
+        last_end_time = max(last_end_time, other.last_end_time);
+        sum_turnaround += other.sum_turnaround;
+        sum_wait_time += other.sum_wait_time;
+        max_wait_time = max(max_wait_time, other.max_wait_time);
+        wait_histogram.add(other.wait_histogram);
+    }
+};
+
+// One SUM[t<stream>] line per stream, after the SUM line : time of its last completion, IO operations, average
+// turnaround, average wait and max wait
+inline void print_stream_summaries(FILE* output, const map<int, StreamSummary>& streams) {
+    for (map<int, StreamSummary>::const_iterator it = streams.begin(); it != streams.end(); it++) {
+        const StreamSummary& summary = it->second;
+        fprintf(output, "SUM[t%d]: %lld %d %.2lf %.2lf %lld\n", it->first, (long long) summary.last_end_time,
+                summary.nb_io_ops, summary.sum_turnaround / summary.nb_io_ops, summary.sum_wait_time / summary.nb_io_ops,
+                (long long) summary.max_wait_time);
+    }
+}
+
+// PCT wait[t<stream>] lines, after the percentiles of the whole trace (-p flag)
+inline void print_stream_wait_percentiles(FILE* output, const map<int, StreamSummary>& streams) {
+    for (map<int, StreamSummary>::const_iterator it = streams.begin(); it != streams.end(); it++) {
+        char name[32];
+        snprintf(name, sizeof(name), "wait[t%d]", it->first);
+        it->second.wait_histogram.print_percentiles(output, name);
+    }
+}
+
+struct Simulator {
+    io_time CLOCK; // internal clock
+    op_index curr_io_op; // Current IO operation
+
+    int64_t tot_movement; // total total number of tracks the head had to be moved
+    double avg_turnaround; // average turnaround time per operation from time of submission to time of completion
+    double avg_wait_time; // average wait time per operation (time from submission to issue of IO request to start disk operation)
+    io_time max_wait_time; // maximum wait time for any IO operation.
+
+    int nb_io_ops; // number of completed IO operations
+
+    // Distributions of the wait time, the turnaround time and the seek distance : the tracks the head moved to serve each
+    // IO operation, so that the seeks add up to tot_movement (FIFO leaves the track of the head and comes back to it)
+    Histogram wait_histogram;
+    Histogram turnaround_histogram;
+    Histogram seek_histogram;
+    int64_t seek_start; // tot_movement when the head started toward the current IO operation
+
+    // Statistics of each stream. Like the sums above they don't need the results, so they also work in streaming mode
+    map<int, StreamSummary> streams;
+    int last_stream; // cache of the last stream looked up, most traces have one stream or long runs of the same one
+    StreamSummary* last_summary;
+
+    Scheduler* scheduler;
+    const IO_pool* io_ops; // where the IO operations are stored
+    IO_input* input; // where the arriving IO operations come from
+    ResultStore results; // result of each IO operation, indexed like the pool
+    FILE* output; // where the IO operations and the summary are printed
+    Tracer* tracer; // NULL when the events are not traced
+    vector<op_index> queue_snapshot; // used to trace the content of the queues
+    vector<op_index>* issue_order; // if not NULL, the IO operations are appended in the order they are issued (replay mode)
+    const vector<int64_t>* measured_latency; // if not NULL, the latency in ns of each IO operation replayed on a real file
+    const CostModel* cost_model; // if not NULL, the access time of each IO operation comes from this model (-M flag)
+    PhaseCounters* counters; // if not NULL, the strategy() calls are counted in PHASE_DISPATCH (-I flag)
+    io_time completion_time; // with a cost model, time when the current IO operation completes
+    io_time stop_time; // the simulation loops return as soon as the CLOCK reaches it (snapshots, see STEP 5bis)
+    op_index overflow_io_op; // IO operation that would end after MAX_TIME : the simulation loops return (NO_OP if none)
+
+    // In streaming mode, each IO operation is printed and released as soon as it completes.
+    // They must be printed in oid order, so the ones completing early wait here for their predecessors
+    bool streaming;
+    map<int, op_index> completed_io_ops;
+    int next_oid_to_print;
+
+    // Merge stage (-g flag). An arriving IO operation within merge_window tracks of a pending request joins its
+    // dispatch unit instead of the request queue. The scheduler only sees the first request of each unit, and when it
+    // dispatches it the whole unit is issued at once and served without calling strategy() again
+    io_track merge_window; // -1 : no merging
+    int merge_max; // most IO operations in a dispatch unit
+    map<io_track, op_index> mergeable; // track -> first request of a unit not dispatched yet
+    map<op_index, vector<op_index> > units; // first request of a unit -> the requests merged into it
+    deque<op_index> unit_rest; // requests of the unit being served, in the order the head reaches them
+    int nb_units; // dispatch units issued (merged or not)
+    int nb_merged; // IO operations merged into another one's unit
+    int max_unit_size;
+
+    Simulator(Scheduler* scheduler_, const IO_pool* io_ops_, IO_input* input_, bool streaming_, FILE* output_ = stdout) {
+        CLOCK = -1;
+        scheduler = scheduler_;
+        curr_io_op = scheduler->curr_io_op;
+        io_ops = io_ops_;
+        input = input_;
+        output = output_;
+        tracer = NULL;
+        issue_order = NULL;
+        measured_latency = NULL;
+        cost_model = NULL;
+        counters = NULL;
+        completion_time = 0;
+        stop_time = MAX_TIME;
+        overflow_io_op = NO_OP;
+        results.resize(io_ops->size());
+        streaming = streaming_;
+        next_oid_to_print = 0;
+        nb_io_ops = 0;
+        merge_window = -1;
+        merge_max = 32;
+        nb_units = 0;
+        nb_merged = 0;
+        max_unit_size = 0;
+        last_stream = -1;
+        last_summary = NULL;
+
+        avg_turnaround = 0;
+        avg_wait_time = 0;
+        max_wait_time = 0;
+        tot_movement = 0;
+        seek_start = 0;
+    }
+
+
+    StreamSummary& stream_summary(op_index io_op) {
+        int stream = io_ops->stream_of(io_op);
+        if (stream != last_stream) {
+            last_stream = stream;
+            last_summary = &streams[stream]; // the nodes of a map never move
+        }
+        return *last_summary;
+    }
+
+    // Check if the next IO operation of the input arrives at the current time
+    bool has_arrival() {
+        op_index next_arrival = input->peek();
+        return next_arrival != NO_OP && io_ops->arrival_time[next_arrival] == CLOCK;
+    }
+
+    void issue(op_index io_op) {
+        // In streaming mode the pool grows as the input is read
+        if (io_op >= results.size()) {
+            results.resize(io_ops->size());
+        }
+        IO_result& result = results.write(io_op);
+        result.start_time = CLOCK;
+        result.wait_time = CLOCK - io_ops->arrival_time[io_op];
+        wait_histogram.record(result.wait_time);
+        stream_summary(io_op).wait_histogram.record(result.wait_time);
+        if (issue_order != NULL) {
+            issue_order->push_back(io_op);
+        }
+    }
+
+    void compute_info(op_index io_op) {
+        IO_result& result = results.write(io_op);
+        result.end_time = CLOCK;
+        result.turnaround_time = CLOCK - io_ops->arrival_time[io_op];
+
+        // Summary statistics are accumulated right away, the averages are computed in print_summary()
+        avg_turnaround += (double) result.turnaround_time;
+        avg_wait_time += (double) result.wait_time;
+        if (result.wait_time > max_wait_time) {
+            max_wait_time = result.wait_time;
+        }
+        nb_io_ops++;
+        turnaround_histogram.record(result.turnaround_time);
+        StreamSummary& summary = stream_summary(io_op);
+        summary.nb_io_ops++;
+        summary.last_end_time = max(summary.last_end_time, result.end_time);
+        summary.sum_turnaround += (double) result.turnaround_time;
+        summary.sum_wait_time += (double) result.wait_time;
+        summary.max_wait_time = max(summary.max_wait_time, result.wait_time);
+
+        if (streaming) {
+            completed_io_ops[io_ops->oid[io_op]] = io_op;
+            map<int, op_index>::iterator it = completed_io_ops.begin();
+            while (it != completed_io_ops.end() && it->first == next_oid_to_print) {
+                print_io_op(it->second);
+                input->release(it->second);
+                completed_io_ops.erase(it++);
+                next_oid_to_print++;
+            }
+        }
+    }
+
+    void print_io_op(op_index io_op) {
+        const IO_result& result = results[io_op];
+        if (measured_latency != NULL) {
+            // Replay mode : the measured latency in microseconds after the simulated times
+            fprintf(output, "%5d: %5lld %5lld %5lld %9.1lf\n", io_ops->oid[io_op], (long long) io_ops->arrival_time[io_op],
+                    (long long) result.start_time, (long long) result.end_time, (*measured_latency)[io_op] / 1000.0);
+            return;
+        }
+        fprintf(output, "%5d: %5lld %5lld %5lld\n", io_ops->oid[io_op], (long long) io_ops->arrival_time[io_op],
+                (long long) result.start_time, (long long) result.end_time);
+    }
+
+
+    // The three events of the simulation. tracing is known at compile time : without it, no tracing code is generated
+    template <bool tracing, class Sched>
+    void add_request(Sched* scheduler) {
+        op_index io_op = input->next();
+        if ( !(merge_window >= 0 && merge(io_op)) ) {
+            scheduler->add_request(io_op);
+        }
+        if (tracing && tracer->verbose) {
+            tracer->record(TRACE_ADD, CLOCK, io_ops->oid[io_op], io_ops->track[io_op], 0);
+        }
+    }
+
+    template <bool tracing, class Sched>
+    void complete(Sched* scheduler) {
+        seek_histogram.record(tot_movement - seek_start);
+        compute_info(curr_io_op);
+        if (tracing && tracer->verbose) {
+            tracer->record(TRACE_COMPLETE, CLOCK, io_ops->oid[curr_io_op], io_ops->track[curr_io_op], results[curr_io_op].turnaround_time);
+        }
+        scheduler->curr_io_op = NO_OP;
+        scheduler->isCompleted = false;
+        curr_io_op = NO_OP;
+        if ( !unit_rest.empty() ) {
+            next_in_unit<tracing>(scheduler);
+        }
+    }
+
+    template <bool tracing, class Sched>
+    void issue_next(Sched* scheduler) {
+        int nb_swaps = scheduler->nb_swaps;
+        if (tracing && (tracer->queues || tracer->flook_queues)) {
+            trace_queue(scheduler, 0);
+            if (tracer->flook_queues) {
+                trace_queue(scheduler, 1);
+            }
+        }
+        scheduler->clock = CLOCK;
+        if (counters != NULL) {
+            counters->start(PHASE_DISPATCH);
+            curr_io_op = scheduler->strategy();
+            counters->stop(PHASE_DISPATCH);
+        } else {
+            curr_io_op = scheduler->strategy();
+        }
+        issue(curr_io_op);
+        seek_start = tot_movement;
+        if (cost_model == NULL) {
+            check_end_time(abs(io_ops->track[curr_io_op] - scheduler->head));
+        }
+        if (tracing && tracer->flook_queues && scheduler->nb_swaps != nb_swaps) {
+            tracer->record(TRACE_SWAP, CLOCK, 0, 0, 0);
+        }
+        if (tracing && tracer->verbose) {
+            tracer->record(TRACE_ISSUE, CLOCK, io_ops->oid[curr_io_op], io_ops->track[curr_io_op], scheduler->head);
+        }
+        if (merge_window >= 0) {
+            dispatch_unit(curr_io_op);
+        }
+    }
+
+    // Find a pending unit for io_op : the closest one on each side of its track, if within the window and not full
+    bool merge(op_index io_op) {
+        io_track track = io_ops->track[io_op];
+        map<io_track, op_index>::iterator above = mergeable.lower_bound(track);
+        map<io_track, op_index>::iterator candidates[2] = {above, mergeable.end()};
+        if (above != mergeable.begin()) {
+            candidates[1] = prev(above);
+        }
+        op_index leader = NO_OP;
+        io_track best_distance = MAX_TRACK;
+        for (int c = 0; c < 2; c++) {
+            if (candidates[c] == mergeable.end()) {
+                continue;
+            }
+            io_track distance = abs(candidates[c]->first - track);
+            map<op_index, vector<op_index> >::iterator unit = units.find(candidates[c]->second);
+            int unit_size = (unit != units.end()) ? unit->second.size() + 1 : 1;
+            if (distance <= merge_window && distance < best_distance && unit_size < merge_max) {
+                leader = candidates[c]->second;
+                best_distance = distance;
+            }
+        }
+        if (leader == NO_OP) {
+            // It starts its own unit (and replaces a full one on the same track)
+            mergeable[track] = io_op;
+            return false;
+        }
+        units[leader].push_back(io_op);
+        nb_merged++;
+        return true;
+    }
+
+    // The scheduler chose leader : issue its whole unit. The head reaches the track of the leader first, then goes on
+    // in the same direction through the merged requests, and finally comes back for the ones on the other side
+    void dispatch_unit(op_index leader) {
+        io_track track = io_ops->track[leader];
+        nb_units++;
+        map<io_track, op_index>::iterator it = mergeable.find(track);
+        if (it != mergeable.end() && it->second == leader) {
+            mergeable.erase(it);
+        }
+        map<op_index, vector<op_index> >::iterator unit = units.find(leader);
+        if (unit == units.end()) {
+            max_unit_size = max(max_unit_size, 1);
+            return;
+        }
+        vector<op_index>& merged = unit->second;
+        int direction = (track >= scheduler->head) ? 1 : -1;
+        vector< pair<pair<bool, io_track>, op_index> > order; // ((behind, distance), request) : ahead first, closest first
+        for (size_t i = 0; i < merged.size(); i++) {
+            io_track offset = (io_ops->track[merged[i]] - track) * direction;
+            order.push_back(make_pair(make_pair(offset < 0, abs(offset)), merged[i]));
+        }
+        stable_sort(order.begin(), order.end(), [](const pair<pair<bool, io_track>, op_index>& a,
+                                                   const pair<pair<bool, io_track>, op_index>& b) {
+            return a.first < b.first;
+        });
+        for (size_t i = 0; i < order.size(); i++) {
+            issue(order[i].second);
+            unit_rest.push_back(order[i].second);
+        }
+        max_unit_size = max(max_unit_size, (int) merged.size() + 1);
+        units.erase(unit);
+    }
+
+    // The current IO operation completed in the middle of a unit : serve the next one without calling strategy().
+    // Without a cost model, the ones on the track of the head complete right away
+    template <bool tracing, class Sched>
+    void next_in_unit(Sched* scheduler) {
+        while ( !unit_rest.empty() ) {
+            op_index io_op = unit_rest.front();
+            unit_rest.pop_front();
+            if (tracing && tracer->verbose) {
+                tracer->record(TRACE_ISSUE, CLOCK, io_ops->oid[io_op], io_ops->track[io_op], scheduler->head);
+            }
+            if (cost_model == NULL && io_ops->track[io_op] == scheduler->head) {
+                seek_histogram.record(0);
+                compute_info(io_op);
+                if (tracing && tracer->verbose) {
+                    tracer->record(TRACE_COMPLETE, CLOCK, io_ops->oid[io_op], io_ops->track[io_op], results[io_op].turnaround_time);
+                }
+                continue;
+            }
+            scheduler->curr_io_op = io_op;
+            curr_io_op = io_op;
+            seek_start = tot_movement;
+            if (cost_model == NULL) {
+                check_end_time(abs(io_ops->track[io_op] - scheduler->head));
+            }
+            return;
+        }
+    }
+
+    // The current IO operation ends duration time units from now. After MAX_TIME its times would overflow io_time :
+    // the simulation stops there instead (see the large-disk mode in the README)
+    void check_end_time(io_time duration) {
+        if (duration > MAX_TIME - CLOCK) {
+            overflow_io_op = curr_io_op;
+        }
+    }
+
+    // With a cost model, the current IO operation (just issued) completes after its access time
+    void start_access() {
+        io_track track = io_ops->track[curr_io_op];
+        tot_movement += abs(track - scheduler->head);
+        io_time duration = cost_model->access_time(scheduler->head, track, io_ops->oid[curr_io_op], CLOCK);
+        check_end_time(duration);
+        completion_time = (overflow_io_op == NO_OP) ? CLOCK + duration : MAX_TIME;
+    }
+
+    void trace_queue(Scheduler* scheduler, int queue) {
+        queue_snapshot.clear();
+        scheduler->queue_contents(queue_snapshot, queue);
+        for (size_t i = 0; i < queue_snapshot.size(); i++) {
+            op_index io_op = queue_snapshot[i];
+            tracer->record(TRACE_QUEUE, CLOCK, io_ops->oid[io_op], io_ops->track[io_op], io_ops->track[io_op] - scheduler->head, queue);
+        }
+    }
+
+
+    // The simulation loops are templates instantiated for each scheduler class : the scheduler calls made at every
+    // step are then resolved at compile time and inlined. simulation() and event_simulation() only dispatch once,
+    // on the dynamic type of the scheduler, to the right instantiation.
+    template <class Sched, bool tracing>
+    void simulation_loop(Sched* scheduler) {
+        if (CLOCK < 1) {
+            CLOCK = 1; // Initialize clock, unless resuming from a snapshot
+        }
+        while (true) {
+            if (CLOCK >= stop_time || overflow_io_op != NO_OP) {
+                return;
+            }
+            curr_io_op = scheduler->curr_io_op;
+
+            while (has_arrival()) { // several IO operations may arrive at the same time
+                add_request<tracing>(scheduler);
+            }
+            if ( curr_io_op != NO_OP && scheduler->isCompleted ) {
+                complete<tracing>(scheduler);
+            }
+            if (curr_io_op == NO_OP) {
+                if ( scheduler->hasRequest() ) {
+                    issue_next<tracing>(scheduler);
+                }
+                else if ( !(scheduler->hasRequest()) && input->peek() == NO_OP ) {
+                    return;
+                }
+            }
+            if (curr_io_op != NO_OP) {
+                io_track temp_past_head = scheduler->head;
+                scheduler->move_head();
+                // Check if head had to be moved
+                if (temp_past_head != scheduler->head) {
+                    tot_movement++;
+                }
+                // Else, it means the head is already on the new IO operation's track so we choose another
+                // Warning edge case : Because one hand movement = 1 time unit, this must happen within the SAME time unit
+                // So we must skip the "CLOCK++" by using a continue statement
+                else {
+                    continue;
+                }
+            }
+
+            CLOCK++;
+
+        } // end of while loop
+    } // end of simulation_loop function
+
+
+    // Same simulation, but instead of ticking the CLOCK one time unit at a time we jump straight to the next event
+    // An event is either the next arrival of the input queue, or the completion of the current IO operation
+    // Each iteration of the loop does exactly what the per-tick loop would do at this CLOCK, so the output is identical
+    template <class Sched, bool tracing>
+    void event_simulation_loop(Sched* scheduler) {
+        if (CLOCK < 1) {
+            CLOCK = 1; // Initialize clock, unless resuming from a snapshot
+        }
+        while (true) {
+            if (CLOCK >= stop_time || overflow_io_op != NO_OP) {
+                return;
+            }
+            curr_io_op = scheduler->curr_io_op;
+
+            while (has_arrival()) {
+                add_request<tracing>(scheduler);
+            }
+            if ( curr_io_op != NO_OP && scheduler->isCompleted ) {
+                complete<tracing>(scheduler);
+            }
+            if (curr_io_op == NO_OP) {
+                if ( scheduler->hasRequest() ) {
+                    issue_next<tracing>(scheduler);
+                }
+                else if ( input->peek() == NO_OP ) {
+                    return;
+                }
+                else {
+                    // Disk is idle : nothing can happen before the next arrival
+                    io_time next_arrival = io_ops->arrival_time[input->peek()];
+                    CLOCK = (next_arrival > CLOCK) ? next_arrival : CLOCK + 1;
+                    CLOCK = min(CLOCK, stop_time);
+                    continue;
+                }
+            }
+
+            io_track distance = abs(io_ops->track[curr_io_op] - scheduler->head);
+            if (distance == 0) {
+                // Head is already on the track : let the scheduler handle it exactly like the per-tick loop
+                // (same time unit if the head doesn't move, see the edge case in simulation())
+                io_track temp_past_head = scheduler->head;
+                scheduler->move_head();
+                if (temp_past_head == scheduler->head) {
+                    continue;
+                }
+                tot_movement++;
+                CLOCK++;
+                continue;
+            }
+
+            // The head moves one track per time unit until it reaches the track or until the next arrival
+            io_track steps = min(distance, stop_time - CLOCK);
+            if (input->peek() != NO_OP) {
+                io_time until_arrival = io_ops->arrival_time[input->peek()] - CLOCK;
+                if (until_arrival < steps) {
+                    steps = (until_arrival > 1) ? until_arrival : 1;
+                }
+            }
+            scheduler->jump_head(steps);
+            tot_movement += steps;
+            CLOCK += steps;
+
+        } // end of while loop
+    } // end of event_simulation_loop function
+
+    // Simulation with a cost model : an IO operation issued at CLOCK completes at CLOCK + access_time(), with the
+    // head jumping to its track at completion. The CLOCK goes straight from event to event (arrival or completion).
+    // The model doesn't follow the head during the seek, so the arrivals meanwhile only join the request queue.
+    template <class Sched, bool tracing>
+    void cost_simulation_loop(Sched* scheduler) {
+        if (CLOCK < 1) {
+            CLOCK = 1; // Initialize clock, unless resuming from a snapshot
+        }
+        while (true) {
+            if (CLOCK >= stop_time || overflow_io_op != NO_OP) {
+                return;
+            }
+            curr_io_op = scheduler->curr_io_op;
+
+            if (has_arrival()) {
+                add_request<tracing>(scheduler);
+                continue; // several IO operations may arrive at the same time
+            }
+            if ( curr_io_op != NO_OP && CLOCK == completion_time ) {
+                scheduler->head = io_ops->track[curr_io_op];
+                complete<tracing>(scheduler);
+                if (curr_io_op != NO_OP) {
+                    // Next IO operation of a merged dispatch unit
+                    start_access();
+                    continue;
+                }
+            }
+            if (curr_io_op == NO_OP) {
+                if ( scheduler->hasRequest() ) {
+                    issue_next<tracing>(scheduler);
+                    start_access();
+                    continue; // an access time of 0 completes in the same time unit
+                }
+                else if ( input->peek() == NO_OP ) {
+                    return;
+                }
+                CLOCK = min(max(CLOCK + 1, io_ops->arrival_time[input->peek()]), stop_time);
+                continue;
+            }
+
+            // Next event : the completion of the current IO operation, or an arrival before it
+            io_time next_event = min(completion_time, stop_time);
+            if (input->peek() != NO_OP) {
+                next_event = min(next_event, io_ops->arrival_time[input->peek()]);
+            }
+            CLOCK = max(CLOCK + 1, next_event);
+
+        } // end of while loop
+    } // end of cost_simulation_loop function
+
+    struct SimulationLoop {
+        Simulator* simulator;
+        template <class Sched> void operator()(Sched* scheduler) {
+            if (simulator->tracer != NULL) {
+                simulator->simulation_loop<Sched, true>(scheduler);
+            } else {
+                simulator->simulation_loop<Sched, false>(scheduler);
+            }
+        }
+    };
+
+    struct CostSimulationLoop {
+        Simulator* simulator;
+        template <class Sched> void operator()(Sched* scheduler) {
+            if (simulator->tracer != NULL) {
+                simulator->cost_simulation_loop<Sched, true>(scheduler);
+            } else {
+                simulator->cost_simulation_loop<Sched, false>(scheduler);
+            }
+        }
+    };
+
+    struct EventSimulationLoop {
+        Simulator* simulator;
+        template <class Sched> void operator()(Sched* scheduler) {
+            if (simulator->tracer != NULL) {
+                simulator->event_simulation_loop<Sched, true>(scheduler);
+            } else {
+                simulator->event_simulation_loop<Sched, false>(scheduler);
+            }
+        }
+    };
+
+    // Call loop with the scheduler casted to its real class
+    template <class Loop>
+    void dispatch(Loop loop) {
+        if (FIFO* fifo = dynamic_cast<FIFO*>(scheduler)) {
+            loop(fifo);
+        } else if (SSTF* sstf = dynamic_cast<SSTF*>(scheduler)) {
+            loop(sstf);
+        } else if (LOOK* look = dynamic_cast<LOOK*>(scheduler)) {
+            loop(look);
+        } else if (CLOOK* clook = dynamic_cast<CLOOK*>(scheduler)) {
+            loop(clook);
+        } else if (FLOOK* flook = dynamic_cast<FLOOK*>(scheduler)) {
+            loop(flook);
+        } else if (DEADLINE* deadline = dynamic_cast<DEADLINE*>(scheduler)) {
+            loop(deadline);
+        } else if (SATF* satf = dynamic_cast<SATF*>(scheduler)) {
+            loop(satf);
+        } else if (FAIRSHARE* fairshare = dynamic_cast<FAIRSHARE*>(scheduler)) {
+            loop(fairshare);
+        } else {
+            loop(scheduler);
+        }
+    }
+
+    // With a cost model, both run the event-driven cost_simulation_loop
+    void simulation() {
+        if (cost_model != NULL) {
+            CostSimulationLoop loop = {this};
+            dispatch(loop);
+            return;
+        }
+        SimulationLoop loop = {this};
+        dispatch(loop);
+    }
+
+    void event_simulation() {
+        if (cost_model != NULL) {
+            CostSimulationLoop loop = {this};
+            dispatch(loop);
+            return;
+        }
+        EventSimulationLoop loop = {this};
+        dispatch(loop);
+    }
+
+    void print_summary() {
+        // In streaming mode, the IO operations were already printed when they completed
+        if (!streaming) {
+            for (op_index io_op = 0; io_op < io_ops->size(); io_op++) {
+                print_io_op(io_op);
+            }
+        }
+
+        print_sum("SUM");
+    }
+
+    // MERGE line (-g flag) : dispatch units, IO operations merged, average and largest unit
+    void print_merge() {
+        fprintf(output, "MERGE: %d %d %.2lf %d\n", nb_units, nb_merged,
+                nb_units > 0 ? (nb_units + nb_merged) / (double) nb_units : 0.0, max_unit_size);
+    }
+
+    // name is SUM, or e.g. SUM[j] for the forks of a snapshot
+    void print_sum(const char* name) {
+        fprintf(output, "%s: %lld %lld %.2lf %.2lf %lld\n", name, (long long) CLOCK, (long long) tot_movement,
+                avg_turnaround / (double) nb_io_ops, avg_wait_time / (double) nb_io_ops, (long long) max_wait_time);
+    }
+
+    // p50 p90 p99 p99.9 of each distribution, after the SUM line (-p flag)
+    void print_percentiles() {
+        wait_histogram.print_percentiles(output, "wait");
+        turnaround_histogram.print_percentiles(output, "turnaround");
+        seek_histogram.print_percentiles(output, "seek");
+    }
+
+    void print_streams() {
+        print_stream_summaries(output, streams);
+    }
+
+    void print_stream_percentiles() {
+        print_stream_wait_percentiles(output, streams);
+    }
+
+    bool dump_histograms(const char* path) {
+        FILE* file = fopen(path, "w");
+        if (file == NULL) {
+            return false;
+        }
+        fprintf(file, "metric,lowest,highest,count\n");
+        wait_histogram.dump_csv(file, "wait");
+        turnaround_histogram.dump_csv(file, "turnaround");
+        seek_histogram.dump_csv(file, "seek");
+        return fclose(file) == 0;
+    }
+
+}; // End of struct simulator
+
+
+//-------------------- STEP 5bis : Snapshots of a simulation --------------------
+// A simulation stopped at some time (stop_time) can be saved in a snapshot : the clock, the statistics, the results,
+// the position in the input, the head and the pending requests of the scheduler. A new simulator can then resume from
+// the snapshot, with the same scheduler or with another one : many what-if runs can share the same warmup.
+// The snapshot shares the chunks of results with the simulations (copy-on-write), and the pool is shared read-only,
+// so forking a simulation doesn't copy the trace. The snapshots only work on a whole trace (VectorInput).
+
+struct Snapshot {
+    char algo; // letter of the scheduler that ran until the snapshot
+
+    // Simulator
+    io_time CLOCK;
+    op_index curr_io_op;
+    io_time completion_time;
+    int64_t tot_movement;
+    int64_t seek_start;
+    double avg_turnaround; // sums, like in the simulator
+    double avg_wait_time;
+    io_time max_wait_time;
+    int nb_io_ops;
+    Histogram wait_histogram;
+    Histogram turnaround_histogram;
+    Histogram seek_histogram;
+    map<int, StreamSummary> streams;
+    ResultStore results;
+    op_index hand_input; // number of IO operations that arrived
+
+    // Scheduler
+    io_track head;
+    bool isCompleted;
+    int nb_swaps;
+    int state; // see Scheduler::save_state()
+    vector<op_index> queues[2]; // pending requests of each queue, in order of arrival
+    vector<int64_t> extra_state; // see Scheduler::save_extra_state()
+};
+
+// Save the state of simulator, whose scheduler is algo. False if its input is not a VectorInput
+inline bool take_snapshot(Simulator& simulator, char algo, Snapshot& snapshot) {
+    VectorInput* input = dynamic_cast<VectorInput*>(simulator.input);
+    if (input == NULL) {
+        return false;
+    }
+    Scheduler* scheduler = simulator.scheduler;
+    snapshot.algo = algo;
+    snapshot.CLOCK = simulator.CLOCK;
+    snapshot.curr_io_op = scheduler->curr_io_op;
+    snapshot.completion_time = simulator.completion_time;
+    snapshot.tot_movement = simulator.tot_movement;
+    snapshot.seek_start = simulator.seek_start;
+    snapshot.avg_turnaround = simulator.avg_turnaround;
+    snapshot.avg_wait_time = simulator.avg_wait_time;
+    snapshot.max_wait_time = simulator.max_wait_time;
+    snapshot.nb_io_ops = simulator.nb_io_ops;
+    snapshot.wait_histogram = simulator.wait_histogram;
+    snapshot.turnaround_histogram = simulator.turnaround_histogram;
+    snapshot.seek_histogram = simulator.seek_histogram;
+    snapshot.streams = simulator.streams;
+    snapshot.results = simulator.results;
+    snapshot.hand_input = input->position();
+
+    snapshot.head = scheduler->head;
+    snapshot.isCompleted = scheduler->isCompleted;
+    snapshot.nb_swaps = scheduler->nb_swaps;
+    snapshot.state = scheduler->save_state();
+    snapshot.extra_state.clear();
+    scheduler->save_extra_state(snapshot.extra_state);
+    for (int queue = 0; queue < 2; queue++) {
+        snapshot.queues[queue].clear();
+        scheduler->queue_contents(snapshot.queues[queue], queue);
+        // The IO operations are in the pool in order of arrival
+        sort(snapshot.queues[queue].begin(), snapshot.queues[queue].end());
+    }
+    return true;
+}
+
+// Resume from snapshot with a new simulator, whose scheduler is algo and was just created on the same pool.
+// With the scheduler of the snapshot the simulation goes on exactly as it would have. With another one, the new
+// scheduler gets all the pending requests in order of arrival and starts from its initial state.
+// False if the input of simulator is not a VectorInput
+inline bool restore_snapshot(Simulator& simulator, char algo, const Snapshot& snapshot) {
+    VectorInput* input = dynamic_cast<VectorInput*>(simulator.input);
+    if (input == NULL) {
+        return false;
+    }
+    simulator.CLOCK = snapshot.CLOCK;
+    simulator.curr_io_op = snapshot.curr_io_op;
+    simulator.completion_time = snapshot.completion_time;
+    simulator.tot_movement = snapshot.tot_movement;
+    simulator.seek_start = snapshot.seek_start;
+    simulator.avg_turnaround = snapshot.avg_turnaround;
+    simulator.avg_wait_time = snapshot.avg_wait_time;
+    simulator.max_wait_time = snapshot.max_wait_time;
+    simulator.nb_io_ops = snapshot.nb_io_ops;
+    simulator.wait_histogram = snapshot.wait_histogram;
+    simulator.turnaround_histogram = snapshot.turnaround_histogram;
+    simulator.seek_histogram = snapshot.seek_histogram;
+    simulator.streams = snapshot.streams;
+    simulator.last_stream = -1; // the cache points into the map replaced
+    simulator.results = snapshot.results;
+    input->seek(snapshot.hand_input);
+
+    Scheduler* scheduler = simulator.scheduler;
+    scheduler->head = snapshot.head;
+    scheduler->curr_io_op = snapshot.curr_io_op;
+    scheduler->isCompleted = snapshot.isCompleted;
+    scheduler->nb_swaps = snapshot.nb_swaps;
+    if (algo == snapshot.algo) {
+        scheduler->restore(snapshot.queues, snapshot.state);
+        scheduler->restore_extra_state(snapshot.extra_state);
+    } else {
+        vector<op_index> queues[2];
+        queues[0] = snapshot.queues[0];
+        queues[0].insert(queues[0].end(), snapshot.queues[1].begin(), snapshot.queues[1].end());
+        sort(queues[0].begin(), queues[0].end());
+        scheduler->Scheduler::restore(queues, 0);
+    }
+    return true;
+}
+
+// Snapshot files (-W and -R flags). Defined in libiosched.cpp
+// The file keeps a fingerprint of the IO operations that arrived : a snapshot can only be loaded with the same trace
+bool save_snapshot(const char* path, const Snapshot& snapshot, const IO_pool& io_ops);
+bool load_snapshot(const char* path, Snapshot& snapshot, const IO_pool& io_ops);
+
+#endif
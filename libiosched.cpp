@@ -0,0 +1,966 @@
+// libiosched : the disk schedulers of iosched as a library. See iosched.h for the online API.
+// The batch simulator of the iosched command line (iosched.cpp) is built from the same pieces, in iosched_core.h.
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <immintrin.h>
+
+#include <limits>
+#include <mutex>
+
+#include "iosched_core.h"
+#include "iosched.h"
+
+//-------------------- STEP 2 : Read Input File and initialize the IO operations queue --------------------
+// Now, we can read the input file and initialize the IO operations queue
+
+// All the IO operations are allocated in the pool in order of their appearance, so op_index == oid.
+// We keep them all because we wanna keep the input for the summary
+bool readInput(istream& input_file, IO_pool& io_ops) {
+
+    string line;
+    int count= 0; // Same as oid. We use the order of arrival as the oid of the IO operation
+    while (getline(input_file, line)) {
+        // We skip the comments lines
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        // <time> <track>, then the optional device and stream columns
+        long long arrival_time, track, device, stream;
+        int nb_columns = sscanf(line.c_str(), "%lld %lld %lld %lld", &arrival_time, &track, &device, &stream);
+        if (nb_columns < 2) {
+            continue;
+        }
+        if ( !check_io_op(count, nb_columns, arrival_time, track, device, stream) ) {
+            return false;
+        }
+        op_index io_op = io_ops.alloc(count, arrival_time, track);
+        if (nb_columns >= 3) {
+            io_ops.set_device(io_op, (int) device);
+        }
+        if (nb_columns == 4) {
+            io_ops.set_stream(io_op, (int) stream);
+        }
+        count++;
+    }
+    return true;
+};
+
+
+// Fast loader (-m flag) : same result as readInput() but the file is memory-mapped and parsed in place.
+// No stream, no locale and no double : the integers are parsed directly from the mapped bytes.
+// The end of each line is found with memchr, which the libc implements with SIMD instructions. The digits are parsed
+// with a scalar loop : each field is a few bytes, too short for a vectorized scan to pay off.
+// Comment lines are skipped anywhere in the file, and malformed lines are reported with their line number.
+
+// Parse a non-negative integer at p. Return NULL if there is no integer or if it is above limit
+static const char* parse_int(const char* p, const char* end, long long limit, long long* value) {
+    if (p == end || (unsigned) (*p - '0') > 9) {
+        return NULL;
+    }
+    long long v = 0;
+    while (p < end && (unsigned) (*p - '0') <= 9) {
+        int digit = *p - '0';
+        if (v > (limit - digit) / 10) {
+            return NULL;
+        }
+        v = v * 10 + digit;
+        p++;
+    }
+    *value = v;
+    return p;
+}
+
+static const char* skip_blanks(const char* p, const char* end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) {
+        p++;
+    }
+    return p;
+}
+
+// Map a whole file in memory for a sequential read. data is NULL for an empty file
+bool map_file(const char* path, const char** data, size_t* size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return false;
+    }
+    *size = st.st_size;
+    *data = NULL;
+    if (*size > 0) {
+        void* mapped = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED) {
+            close(fd);
+            return false;
+        }
+        madvise(mapped, *size, MADV_SEQUENTIAL);
+        *data = (const char*) mapped;
+    }
+    close(fd);
+    return true;
+}
+
+// Print the loading throughput of the file path on the standard error
+void report_load(const char* path, int count, size_t size, struct timespec& start) {
+    struct timespec stop;
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    double seconds = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+    double megabytes = size / (1024.0 * 1024.0);
+    fprintf(stderr, "%s: loaded %d IO operations (%.2lf MB) in %.3lf s : %.1lf MB/s\n",
+            path, count, megabytes, seconds, (seconds > 0) ? megabytes / seconds : 0.0);
+}
+
+// Return false if the file can't be read or has malformed lines
+// If header is given, it is filled from the "#numio=..." comment line when there is one
+bool loadInput(const char* path, IO_pool& io_ops, TraceHeader* header) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    size_t size;
+    const char* data;
+    if ( !map_file(path, &data, &size) ) {
+        return false;
+    }
+
+    io_ops.reserve(size / 8); // rough guess of the number of lines, avoids most of the reallocations
+
+    int count = 0; // Same as oid. We use the order of arrival as the oid of the IO operation
+    int nb_malformed = 0;
+    int line_number = 0;
+    const char* end = data + size;
+    const char* p = data;
+    while (p < end) {
+        line_number++;
+        const char* eol = (const char*) memchr(p, '\n', end - p);
+        if (eol == NULL) {
+            eol = end;
+        }
+        const char* q = skip_blanks(p, eol);
+        // Comments and empty lines are ignored, except the header of the io generator
+        if (header != NULL && q < eol && *q == '#' && eol - q < 256) {
+            char comment[256];
+            memcpy(comment, q, eol - q);
+            comment[eol - q] = '\0';
+            sscanf(comment, "#numio=%lld maxtracks=%lld lambda=%lf", &header->numio, &header->maxtracks, &header->lambda);
+        }
+        else if (q < eol && *q != '#') {
+            long long arrival_time, track;
+            q = parse_int(q, eol, MAX_TIME, &arrival_time);
+            const char* r = (q != NULL) ? skip_blanks(q, eol) : NULL;
+            if (r != NULL && r != q) {
+                r = parse_int(r, eol, MAX_TRACK, &track);
+            } else {
+                r = NULL;
+            }
+            // Optional 3rd column : the device of the IO operation (multi-device mode), then 4th column : its stream
+            long long device = -1, stream = -1;
+            if (r != NULL) {
+                const char* d = skip_blanks(r, eol);
+                if (d != r && d != eol) {
+                    r = parse_int(d, eol, INT_MAX, &device);
+                }
+            }
+            if (r != NULL && device >= 0) {
+                const char* t = skip_blanks(r, eol);
+                if (t != r && t != eol) {
+                    r = parse_int(t, eol, INT_MAX, &stream);
+                }
+            }
+            if (r == NULL || skip_blanks(r, eol) != eol) {
+                fprintf(stderr, "%s:%d: malformed IO operation\n", path, line_number);
+                nb_malformed++;
+            } else {
+                op_index io_op = io_ops.alloc(count, arrival_time, track);
+                if (device >= 0) {
+                    io_ops.set_device(io_op, (int) device);
+                }
+                if (stream >= 0) {
+                    io_ops.set_stream(io_op, (int) stream);
+                }
+                count++;
+            }
+        }
+        p = eol + 1;
+    }
+
+    if (data != NULL) {
+        munmap((void*) data, size);
+    }
+
+    report_load(path, count, size, start);
+
+    return nb_malformed == 0 && count > 0;
+}
+
+
+// Binary trace format (-B flag to load it, -C flag to convert from/to the text format).
+// A fixed header followed by one record per IO operation. Each record is the difference with the previous
+// IO operation for the arrival time, then for the track, zigzag and varint encoded (LEB128) :
+// consecutive arrivals and nearby tracks take 1 or 2 bytes each instead of a whole text line.
+// Version 2 is for the traces with the optional columns : the records also have the device, then the stream when
+// there are 4 columns, encoded the same way. The traces without them are still written in version 1.
+//
+//   offset  0 : magic "IOTB"
+//   offset  4 : version (uint32)
+//   offset  8 : numio, number of records (uint64)
+//   offset 16 : maxtracks (uint64)
+//   offset 24 : lambda (double)
+//   offset 32 : version 1 : records
+//               version 2 : number of columns, 3 or 4 (uint32), 4 bytes of padding, then the records at offset 40
+// All the fields are little endian.
+
+const char BINARY_TRACE_MAGIC[4] = {'I', 'O', 'T', 'B'};
+const uint32_t BINARY_TRACE_VERSION = 2; // the latest one, the loader reads both
+const size_t BINARY_TRACE_HEADER_SIZE = 32;
+const size_t BINARY_TRACE_COLUMNS_SIZE = 8; // after the header, in version 2
+
+// Columns of the text form of a trace : 2, 3 with the device and 4 with the device and the stream
+static int nb_columns(const IO_pool& io_ops) {
+    return !io_ops.stream.empty() ? 4 : !io_ops.device.empty() ? 3 : 2;
+}
+
+static void put_varint(string& out, long long delta) {
+    uint64_t v = ((uint64_t) delta << 1) ^ (uint64_t) (delta >> 63); // zigzag : small negative numbers stay small
+    while (v >= 0x80) {
+        out.push_back((char) (v | 0x80));
+        v >>= 7;
+    }
+    out.push_back((char) v);
+}
+
+// Return NULL if the varint runs past the end of the data
+static const unsigned char* get_varint(const unsigned char* p, const unsigned char* end, long long* delta) {
+    uint64_t v = 0;
+    int shift = 0;
+    while (p < end && shift < 64) {
+        unsigned char byte = *p++;
+        v |= (uint64_t) (byte & 0x7f) << shift;
+        if (byte < 0x80) {
+            *delta = (long long) (v >> 1) ^ -(long long) (v & 1);
+            return p;
+        }
+        shift += 7;
+    }
+    return NULL;
+}
+
+bool is_binary_trace(const char* path) {
+    char magic[4];
+    ifstream file(path, ios::binary);
+    return file.read(magic, 4) && memcmp(magic, BINARY_TRACE_MAGIC, 4) == 0;
+}
+
+// Return false if the file can't be read or is not a valid binary trace
+bool loadBinaryInput(const char* path, IO_pool& io_ops, TraceHeader* header) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    size_t size;
+    const char* data;
+    if ( !map_file(path, &data, &size) ) {
+        return false;
+    }
+
+    uint32_t version = 0, columns = 2;
+    uint64_t numio = 0, maxtracks = 0;
+    double lambda = 0;
+    size_t records_offset = BINARY_TRACE_HEADER_SIZE;
+    if (size >= BINARY_TRACE_HEADER_SIZE) {
+        memcpy(&version, data + 4, 4);
+        memcpy(&numio, data + 8, 8);
+        memcpy(&maxtracks, data + 16, 8);
+        memcpy(&lambda, data + 24, 8);
+    }
+    if (version == 2 && size >= BINARY_TRACE_HEADER_SIZE + BINARY_TRACE_COLUMNS_SIZE) {
+        memcpy(&columns, data + BINARY_TRACE_HEADER_SIZE, 4);
+        records_offset += BINARY_TRACE_COLUMNS_SIZE;
+    }
+    bool known_version = version == 1 || (version == 2 && (columns == 3 || columns == 4));
+    if (size < records_offset || memcmp(data, BINARY_TRACE_MAGIC, 4) != 0 || !known_version) {
+        fprintf(stderr, "%s: not a binary trace (version 1 to %u)\n", path, BINARY_TRACE_VERSION);
+        if (data != NULL) {
+            munmap((void*) data, size);
+        }
+        return false;
+    }
+    if (header != NULL) {
+        header->numio = numio;
+        header->maxtracks = maxtracks;
+        header->lambda = lambda;
+    }
+
+    io_ops.reserve(numio);
+    const unsigned char* p = (const unsigned char*) data + records_offset;
+    const unsigned char* end = (const unsigned char*) data + size;
+    long long arrival_time = 0, track = 0, device = 0, stream = 0;
+    int count = 0; // Same as oid. We use the order of arrival as the oid of the IO operation
+    for (uint64_t i = 0; i < numio; i++) {
+        long long delta_arrival, delta_track, delta_device = 0, delta_stream = 0;
+        if ( (p = get_varint(p, end, &delta_arrival)) == NULL || (p = get_varint(p, end, &delta_track)) == NULL
+             || (columns >= 3 && (p = get_varint(p, end, &delta_device)) == NULL)
+             || (columns == 4 && (p = get_varint(p, end, &delta_stream)) == NULL) ) {
+            fprintf(stderr, "%s: truncated after %d IO operations\n", path, count);
+            break;
+        }
+        arrival_time += delta_arrival;
+        track += delta_track;
+        device += delta_device;
+        stream += delta_stream;
+        if (arrival_time < 0 || arrival_time > MAX_TIME || track < 0 || track > MAX_TRACK || device < 0
+            || device > INT_MAX || stream < 0 || stream > INT_MAX) {
+            fprintf(stderr, "%s: IO operation %d out of range (see the large-disk mode in the README)\n", path, count);
+            break;
+        }
+        op_index io_op = io_ops.alloc(count, arrival_time, track);
+        if (columns >= 3) {
+            io_ops.set_device(io_op, (int) device);
+        }
+        if (columns == 4) {
+            io_ops.set_stream(io_op, (int) stream);
+        }
+        count++;
+    }
+    munmap((void*) data, size);
+
+    report_load(path, count, size, start);
+
+    return (uint64_t) count == numio && count > 0;
+}
+
+bool writeBinaryTrace(const char* path, IO_pool& io_ops, TraceHeader& header) {
+    ofstream file(path, ios::binary);
+    if ( !file.is_open() ) {
+        return false;
+    }
+    char raw_header[BINARY_TRACE_HEADER_SIZE + BINARY_TRACE_COLUMNS_SIZE] = {0};
+    uint32_t columns = nb_columns(io_ops);
+    uint32_t version = (columns == 2) ? 1 : 2;
+    uint64_t numio = io_ops.size();
+    uint64_t maxtracks = header.maxtracks;
+    memcpy(raw_header, BINARY_TRACE_MAGIC, 4);
+    memcpy(raw_header + 4, &version, 4);
+    memcpy(raw_header + 8, &numio, 8);
+    memcpy(raw_header + 16, &maxtracks, 8);
+    memcpy(raw_header + 24, &header.lambda, 8);
+    memcpy(raw_header + BINARY_TRACE_HEADER_SIZE, &columns, 4);
+    file.write(raw_header, BINARY_TRACE_HEADER_SIZE + ((version == 2) ? BINARY_TRACE_COLUMNS_SIZE : 0));
+
+    string records;
+    long long arrival_time = 0, track = 0, device = 0, stream = 0;
+    for (op_index io_op = 0; io_op < io_ops.size(); io_op++) {
+        put_varint(records, io_ops.arrival_time[io_op] - arrival_time);
+        put_varint(records, io_ops.track[io_op] - track);
+        arrival_time = io_ops.arrival_time[io_op];
+        track = io_ops.track[io_op];
+        if (columns >= 3) {
+            put_varint(records, io_ops.device_of(io_op) - device);
+            device = io_ops.device_of(io_op);
+        }
+        if (columns == 4) {
+            put_varint(records, io_ops.stream_of(io_op) - stream);
+            stream = io_ops.stream_of(io_op);
+        }
+        if (records.size() > (1 << 20)) {
+            file.write(records.data(), records.size());
+            records.clear();
+        }
+    }
+    file.write(records.data(), records.size());
+    return (bool) file;
+}
+
+bool writeTextTrace(const char* path, IO_pool& io_ops, TraceHeader& header) {
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        return false;
+    }
+    fprintf(file, "#io generator\n");
+    fprintf(file, "#numio=%d maxtracks=%lld lambda=%lf\n", (int) io_ops.size(), header.maxtracks, header.lambda);
+    int columns = nb_columns(io_ops);
+    for (op_index io_op = 0; io_op < io_ops.size(); io_op++) {
+        fprintf(file, "%lld %lld", (long long) io_ops.arrival_time[io_op], (long long) io_ops.track[io_op]);
+        if (columns >= 3) {
+            fprintf(file, " %d", io_ops.device_of(io_op));
+        }
+        if (columns == 4) {
+            fprintf(file, " %d", io_ops.stream_of(io_op));
+        }
+        fprintf(file, "\n");
+    }
+    return fclose(file) == 0;
+}
+
+// Convert a text trace to the binary format, or a binary trace to the text format
+bool convertTrace(const char* input_path, const char* output_path) {
+    IO_pool io_ops;
+    TraceHeader header;
+    if (is_binary_trace(input_path)) {
+        return loadBinaryInput(input_path, io_ops, &header) && writeTextTrace(output_path, io_ops, header);
+    }
+    return loadInput(input_path, io_ops, &header) && writeBinaryTrace(output_path, io_ops, header);
+}
+
+
+//-------------------- STEP 3bis : Create the request queues used by the schedulers --------------------
+
+// Nearest-track search kernels of SimdQueue. Each track gets a key, the distance to from in the searched direction,
+// or NO_KEY when the track is in the other direction. The kernels return the position of the first smallest key
+// (the earliest request among the ties), or -1 if all the keys are NO_KEY.
+// The keys are unsigned : a distance is at most MAX_TRACK, so NO_KEY, the largest unsigned value, is never a real
+// distance, not even the one from track 0 to track INT_MAX.
+// The search is done in two vectorized passes : a min reduction over all the keys, then a search of the first key
+// equal to the min. The AVX2 and SSE4.1 versions are compiled with the target attribute and chosen at run time,
+// so the binary still runs on a CPU without them.
+
+// The large-disk builds have 64-bit tracks : only the scalar kernel is compiled, and s and 4 are the same as 1.
+
+#ifdef IOSCHED_LARGE_DISK
+typedef uint64_t track_key;
+#else
+typedef uint32_t track_key;
+#endif
+static const track_key NO_KEY = numeric_limits<track_key>::max();
+
+static inline track_key seek_key(io_track track, io_track from, int direction) {
+    io_track distance = track - from;
+    if (direction == SEEK_NEAREST) {
+        return (track_key) abs(distance);
+    }
+    if (direction == SEEK_BELOW) {
+        distance = -distance;
+    }
+    return (distance >= 0) ? (track_key) distance : NO_KEY;
+}
+
+static int first_closest_scalar(const io_track* tracks, int n, io_track from, int direction) {
+    int shortest_pos = -1;
+    track_key shortest_key = NO_KEY;
+    for (int pos = 0; pos < n; pos++) {
+        track_key key = seek_key(tracks[pos], from, direction);
+        if (key < shortest_key) {
+            shortest_key = key;
+            shortest_pos = pos;
+        }
+    }
+    return shortest_pos;
+}
+
+#ifndef IOSCHED_LARGE_DISK
+__attribute__((target("sse4.1")))
+static inline __m128i seek_keys_sse41(__m128i tracks, __m128i from, int direction) {
+    __m128i distance = (direction == SEEK_BELOW) ? _mm_sub_epi32(from, tracks) : _mm_sub_epi32(tracks, from);
+    if (direction == SEEK_NEAREST) {
+        return _mm_abs_epi32(distance);
+    }
+    // The mask of the other direction is all ones, i.e. NO_KEY
+    __m128i wrong_direction = _mm_cmplt_epi32(distance, _mm_setzero_si128());
+    return _mm_or_si128(distance, wrong_direction);
+}
+
+__attribute__((target("sse4.1")))
+static int first_closest_sse41(const int* tracks, int n, int from, int direction) {
+    __m128i from4 = _mm_set1_epi32(from);
+    __m128i min4 = _mm_set1_epi32(-1);
+    int pos = 0;
+    for (; pos + 4 <= n; pos += 4) {
+        __m128i keys = seek_keys_sse41(_mm_loadu_si128((const __m128i*) (tracks + pos)), from4, direction);
+        min4 = _mm_min_epu32(min4, keys);
+    }
+    min4 = _mm_min_epu32(min4, _mm_shuffle_epi32(min4, _MM_SHUFFLE(1, 0, 3, 2)));
+    min4 = _mm_min_epu32(min4, _mm_shuffle_epi32(min4, _MM_SHUFFLE(2, 3, 0, 1)));
+    track_key shortest_key = (track_key) _mm_cvtsi128_si32(min4);
+    for (int tail = pos; tail < n; tail++) {
+        shortest_key = min(shortest_key, seek_key(tracks[tail], from, direction));
+    }
+    if (shortest_key == NO_KEY) {
+        return -1;
+    }
+
+    __m128i target = _mm_set1_epi32((int) shortest_key);
+    for (pos = 0; pos + 4 <= n; pos += 4) {
+        __m128i keys = seek_keys_sse41(_mm_loadu_si128((const __m128i*) (tracks + pos)), from4, direction);
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(keys, target)));
+        if (mask != 0) {
+            return pos + __builtin_ctz(mask);
+        }
+    }
+    for (; pos < n; pos++) {
+        if (seek_key(tracks[pos], from, direction) == shortest_key) {
+            return pos;
+        }
+    }
+    return -1;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i seek_keys_avx2(__m256i tracks, __m256i from, int direction) {
+    __m256i distance = (direction == SEEK_BELOW) ? _mm256_sub_epi32(from, tracks) : _mm256_sub_epi32(tracks, from);
+    if (direction == SEEK_NEAREST) {
+        return _mm256_abs_epi32(distance);
+    }
+    __m256i wrong_direction = _mm256_cmpgt_epi32(_mm256_setzero_si256(), distance);
+    return _mm256_or_si256(distance, wrong_direction);
+}
+
+__attribute__((target("avx2")))
+static int first_closest_avx2(const int* tracks, int n, int from, int direction) {
+    __m256i from8 = _mm256_set1_epi32(from);
+    __m256i min8 = _mm256_set1_epi32(-1);
+    int pos = 0;
+    for (; pos + 8 <= n; pos += 8) {
+        __m256i keys = seek_keys_avx2(_mm256_loadu_si256((const __m256i*) (tracks + pos)), from8, direction);
+        min8 = _mm256_min_epu32(min8, keys);
+    }
+    __m128i min4 = _mm_min_epu32(_mm256_castsi256_si128(min8), _mm256_extracti128_si256(min8, 1));
+    min4 = _mm_min_epu32(min4, _mm_shuffle_epi32(min4, _MM_SHUFFLE(1, 0, 3, 2)));
+    min4 = _mm_min_epu32(min4, _mm_shuffle_epi32(min4, _MM_SHUFFLE(2, 3, 0, 1)));
+    track_key shortest_key = (track_key) _mm_cvtsi128_si32(min4);
+    for (int tail = pos; tail < n; tail++) {
+        shortest_key = min(shortest_key, seek_key(tracks[tail], from, direction));
+    }
+    if (shortest_key == NO_KEY) {
+        return -1;
+    }
+
+    __m256i target = _mm256_set1_epi32((int) shortest_key);
+    for (pos = 0; pos + 8 <= n; pos += 8) {
+        __m256i keys = seek_keys_avx2(_mm256_loadu_si256((const __m256i*) (tracks + pos)), from8, direction);
+        int mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(keys, target)));
+        if (mask != 0) {
+            return pos + __builtin_ctz(mask);
+        }
+    }
+    for (; pos < n; pos++) {
+        if (seek_key(tracks[pos], from, direction) == shortest_key) {
+            return pos;
+        }
+    }
+    return -1;
+}
+
+#endif
+
+// Best kernel for this CPU
+FirstClosestKernel first_closest_kernel() {
+#ifdef IOSCHED_LARGE_DISK
+    return first_closest_scalar;
+#else
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return first_closest_avx2;
+    }
+    if (__builtin_cpu_supports("sse4.1")) {
+        return first_closest_sse41;
+    }
+    return first_closest_scalar;
+#endif
+}
+
+
+// Create a request queue given the backend letter of the -b flag
+// s picks the best SIMD kernel for the CPU. 4 forces the SSE4.1 kernel and 1 the scalar one, to compare them
+RequestQueue* new_request_queue(char backend) {
+    static FirstClosestKernel best_kernel = first_closest_kernel();
+    switch (backend) {
+        case 's' :
+            return new SimdQueue(best_kernel);
+        case '4' :
+#ifdef IOSCHED_LARGE_DISK
+            return new SimdQueue(first_closest_scalar);
+#else
+            return new SimdQueue(first_closest_sse41);
+#endif
+        case '1' :
+            return new SimdQueue(first_closest_scalar);
+        case 't' :
+            return new TreeQueue();
+        case 'h' :
+            return new BitmapQueue();
+        case 'v' :
+        default :
+            return new ScanQueue();
+    }
+}
+
+
+//-------------------- STEP 4 : Create the different Scheduler Algorithms --------------------
+
+// Create a scheduler given the letter of the -s flag. NULL if the letter is unknown
+Scheduler* new_scheduler(char algo, const IO_pool* io_ops, char backend, const SchedulerConfig& config) {
+    switch (algo) {
+        case 'i' :
+            return new FIFO(io_ops);
+        case 'j' :
+            return new SSTF(io_ops, backend);
+        case 's' :
+            return new LOOK(io_ops, backend, config.look_forward);
+        case 'c' :
+            return new CLOOK(io_ops, backend);
+        case 'f' :
+            return new FLOOK(io_ops, backend, config.look_forward, config.flook_batch);
+        case 'd' :
+            return new DEADLINE(io_ops, config.expire, config.fifo_batch, config.cost_model);
+        case 'a' :
+            return new SATF(io_ops, config.cost_model);
+        case 'w' :
+            return new FAIRSHARE(io_ops, backend, config.fair_budget, config.stream_weights, config.cost_model);
+        default :
+            return NULL;
+    }
+}
+
+
+
+//-------------------- STEP 4quater : Performance counters of the phases of a run --------------------
+
+static const char* PHASE_NAMES[NB_PHASES] = {"load", "simulation", "dispatch", "output"};
+static const char* COUNTER_NAMES[NB_COUNTERS] = {"cycles", "instructions", "cache-misses", "branch-misses"};
+static const uint64_t COUNTER_CONFIGS[NB_COUNTERS] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                                      PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+
+PhaseCounters::PhaseCounters() {
+    memset(totals, 0, sizeof(totals));
+    memset(started, 0, sizeof(started));
+    memset(nb_runs, 0, sizeof(nb_runs));
+    nb_opened = 0;
+    int leader = -1;
+    for (int c = 0; c < NB_COUNTERS; c++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = COUNTER_CONFIGS[c];
+        attr.exclude_kernel = 1; // allowed with perf_event_paranoid up to 2
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+        // A counter the CPU (or the virtual machine) doesn't have is left out, the others still work
+        fds[c] = syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+        positions[c] = -1;
+        if (fds[c] >= 0) {
+            positions[c] = nb_opened++;
+            if (leader < 0) {
+                leader = fds[c];
+            }
+        }
+    }
+}
+
+PhaseCounters::~PhaseCounters() {
+    for (int c = 0; c < NB_COUNTERS; c++) {
+        if (fds[c] >= 0) {
+            close(fds[c]);
+        }
+    }
+}
+
+void PhaseCounters::read_values(int64_t* values) {
+    for (int c = 0; c < NB_COUNTERS; c++) {
+        values[1 + c] = 0;
+    }
+    if (nb_opened > 0) {
+        // The whole group at once : number of counters, then their values in the order they were opened
+        uint64_t group[1 + NB_COUNTERS];
+        int leader = 0;
+        while (fds[leader] < 0) {
+            leader++;
+        }
+        if (read(fds[leader], group, sizeof(group)) > 0) {
+            for (int c = 0; c < NB_COUNTERS; c++) {
+                values[1 + c] = (positions[c] >= 0) ? (int64_t) group[1 + positions[c]] : 0;
+            }
+        }
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    values[0] = (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void PhaseCounters::print(FILE* file, int nb_io_ops) {
+    fprintf(file, "PHASE: counters %s", hardware() ? "perf" : "clock");
+    for (int c = 0; c < NB_COUNTERS; c++) {
+        if (positions[c] >= 0) {
+            fprintf(file, " %s", COUNTER_NAMES[c]);
+        }
+    }
+    fprintf(file, "\n");
+
+    // The simulation without the dispatches is an extra line, "move"
+    int64_t rest[NB_COUNTERS + 1];
+    for (int v = 0; v <= NB_COUNTERS; v++) {
+        rest[v] = totals[PHASE_SIMULATION][v] - totals[PHASE_DISPATCH][v];
+    }
+    for (int p = 0; p <= NB_PHASES; p++) {
+        const int64_t* values = (p < NB_PHASES) ? totals[p] : rest;
+        int64_t runs = (p < NB_PHASES) ? nb_runs[p] : nb_runs[PHASE_SIMULATION];
+        if (runs == 0) {
+            continue;
+        }
+        // The dispatches are counted per call, the other phases per IO operation
+        int64_t per = (p == PHASE_DISPATCH) ? runs : nb_io_ops;
+        fprintf(file, "PHASE: %s %lld %lld %.1lf", (p < NB_PHASES) ? PHASE_NAMES[p] : "move", (long long) runs,
+                (long long) values[0], values[0] / (double) max(per, (int64_t) 1));
+        for (int c = 0; c < NB_COUNTERS; c++) {
+            if (positions[c] >= 0) {
+                fprintf(file, " %lld", (long long) values[1 + c]);
+            }
+        }
+        fprintf(file, "\n");
+    }
+}
+
+
+
+//-------------------- STEP 5bis : Snapshots of a simulation --------------------
+// Snapshot file : magic "IOSS", version (uint32), number of IO operations of the trace (uint64), IO operations that
+// arrived (uint32) and the FNV-1a hash of their arrival times and tracks (uint64), then the fields of the Snapshot
+// in their order, the results of the IO operations that arrived, the two queues (size then op_index), the extra
+// state of the scheduler (size then int64_t) and the statistics of the streams (number, then id, fields and histogram).
+// The fields are written as they are in memory : a snapshot is meant to be resumed on the same machine.
+
+const char SNAPSHOT_MAGIC[4] = {'I', 'O', 'S', 'S'};
+// Version 2 has a 64-bit movement, version 3 the extra state, version 4 the streams, version 5 the sums of the
+// histograms and the start of the current seek. The large-disk builds (64-bit times and tracks) write their own version
+#ifdef IOSCHED_LARGE_DISK
+const uint32_t SNAPSHOT_VERSION = 0x105;
+#else
+const uint32_t SNAPSHOT_VERSION = 5;
+#endif
+
+template <class T>
+static bool put(FILE* file, const T& value) {
+    return fwrite(&value, sizeof(T), 1, file) == 1;
+}
+
+template <class T>
+static bool get(FILE* file, T& value) {
+    return fread(&value, sizeof(T), 1, file) == 1;
+}
+
+static uint64_t fingerprint(const IO_pool& io_ops, op_index nb_io_ops) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (op_index io_op = 0; io_op < nb_io_ops; io_op++) {
+        hash = (hash ^ (uint64_t) io_ops.arrival_time[io_op]) * 1099511628211ULL;
+        hash = (hash ^ (uint64_t) io_ops.track[io_op]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+bool save_snapshot(const char* path, const Snapshot& snapshot, const IO_pool& io_ops) {
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        return false;
+    }
+    bool ok = fwrite(SNAPSHOT_MAGIC, 4, 1, file) == 1 && put(file, SNAPSHOT_VERSION) && put(file, (uint64_t) io_ops.size())
+        && put(file, snapshot.hand_input) && put(file, fingerprint(io_ops, snapshot.hand_input))
+        && put(file, snapshot.algo) && put(file, snapshot.CLOCK) && put(file, snapshot.curr_io_op)
+        && put(file, snapshot.completion_time) && put(file, snapshot.tot_movement) && put(file, snapshot.seek_start)
+        && put(file, snapshot.avg_turnaround)
+        && put(file, snapshot.avg_wait_time) && put(file, snapshot.max_wait_time) && put(file, snapshot.nb_io_ops)
+        && snapshot.wait_histogram.write(file) && snapshot.turnaround_histogram.write(file)
+        && snapshot.seek_histogram.write(file)
+        && put(file, snapshot.head) && put(file, snapshot.isCompleted) && put(file, snapshot.nb_swaps)
+        && put(file, snapshot.state);
+    for (op_index io_op = 0; ok && io_op < snapshot.hand_input; io_op++) {
+        ok = put(file, snapshot.results[io_op]);
+    }
+    for (int queue = 0; ok && queue < 2; queue++) {
+        uint64_t size = snapshot.queues[queue].size();
+        ok = put(file, size) && fwrite(snapshot.queues[queue].data(), sizeof(op_index), size, file) == size;
+    }
+    uint64_t extra_size = snapshot.extra_state.size();
+    ok = ok && put(file, extra_size)
+        && fwrite(snapshot.extra_state.data(), sizeof(int64_t), extra_size, file) == extra_size;
+    ok = ok && put(file, (uint64_t) snapshot.streams.size());
+    for (map<int, StreamSummary>::const_iterator it = snapshot.streams.begin(); ok && it != snapshot.streams.end(); it++) {
+        const StreamSummary& summary = it->second;
+        ok = put(file, it->first) && put(file, summary.nb_io_ops) && put(file, summary.last_end_time)
+            && put(file, summary.sum_turnaround) && put(file, summary.sum_wait_time) && put(file, summary.max_wait_time)
+            && summary.wait_histogram.write(file);
+    }
+    return fclose(file) == 0 && ok;
+}
+
+bool load_snapshot(const char* path, Snapshot& snapshot, const IO_pool& io_ops) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        return false;
+    }
+    char magic[4];
+    uint32_t version = 0;
+    uint64_t numio = 0, hash = 0;
+    bool ok = fread(magic, 4, 1, file) == 1 && memcmp(magic, SNAPSHOT_MAGIC, 4) == 0
+        && get(file, version) && version == SNAPSHOT_VERSION && get(file, numio) && get(file, snapshot.hand_input)
+        && get(file, hash);
+    if (ok && (numio != io_ops.size() || snapshot.hand_input > io_ops.size() || hash != fingerprint(io_ops, snapshot.hand_input))) {
+        fprintf(stderr, "%s: the snapshot was taken on another trace\n", path);
+        ok = false;
+    }
+    ok = ok && get(file, snapshot.algo) && get(file, snapshot.CLOCK) && get(file, snapshot.curr_io_op)
+        && get(file, snapshot.completion_time) && get(file, snapshot.tot_movement) && get(file, snapshot.seek_start)
+        && get(file, snapshot.avg_turnaround)
+        && get(file, snapshot.avg_wait_time) && get(file, snapshot.max_wait_time) && get(file, snapshot.nb_io_ops)
+        && snapshot.wait_histogram.read(file) && snapshot.turnaround_histogram.read(file)
+        && snapshot.seek_histogram.read(file)
+        && get(file, snapshot.head) && get(file, snapshot.isCompleted) && get(file, snapshot.nb_swaps)
+        && get(file, snapshot.state);
+    if (ok) {
+        snapshot.results.resize(io_ops.size());
+    }
+    for (op_index io_op = 0; ok && io_op < snapshot.hand_input; io_op++) {
+        ok = get(file, snapshot.results.write(io_op));
+    }
+    for (int queue = 0; ok && queue < 2; queue++) {
+        uint64_t size = 0;
+        ok = get(file, size) && size <= io_ops.size();
+        if (ok) {
+            snapshot.queues[queue].resize(size);
+            ok = fread(snapshot.queues[queue].data(), sizeof(op_index), size, file) == size;
+        }
+    }
+    uint64_t extra_size = 0;
+    ok = ok && get(file, extra_size) && extra_size <= 2 * ((uint64_t) io_ops.size() + 2);
+    if (ok) {
+        snapshot.extra_state.resize(extra_size);
+        ok = fread(snapshot.extra_state.data(), sizeof(int64_t), extra_size, file) == extra_size;
+    }
+    uint64_t nb_streams = 0;
+    ok = ok && get(file, nb_streams) && nb_streams <= (uint64_t) io_ops.size() + 1;
+    snapshot.streams.clear();
+    for (uint64_t i = 0; ok && i < nb_streams; i++) {
+        int id = 0;
+        ok = get(file, id);
+        StreamSummary& summary = snapshot.streams[id];
+        ok = ok && get(file, summary.nb_io_ops) && get(file, summary.last_end_time) && get(file, summary.sum_turnaround)
+            && get(file, summary.sum_wait_time) && get(file, summary.max_wait_time) && summary.wait_histogram.read(file);
+    }
+    for (int queue = 0; ok && queue < 2; queue++) {
+        for (size_t i = 0; i < snapshot.queues[queue].size(); i++) {
+            ok = ok && snapshot.queues[queue][i] < snapshot.hand_input;
+        }
+    }
+    ok = ok && (snapshot.curr_io_op == NO_OP || snapshot.curr_io_op < snapshot.hand_input);
+    fclose(file);
+    return ok;
+}
+
+
+//-------------------- Online API of iosched.h --------------------
+// The requests live in an IO pool like the ones of the simulator. Their slot is released as soon as they complete,
+// so the memory is bounded by the requests not completed yet, like in the streaming mode of the simulator.
+
+namespace iosched {
+
+static int64_t monotonic_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+OnlineScheduler* OnlineScheduler::create(char algo, char backend, int expire_ms, int fifo_batch) {
+    IO_pool* io_ops = new IO_pool();
+    SchedulerConfig config;
+    config.expire = expire_ms;
+    config.fifo_batch = fifo_batch;
+    Scheduler* scheduler = new_scheduler(algo, io_ops, backend, config);
+    if (scheduler == NULL) {
+        delete io_ops;
+        return NULL;
+    }
+    return new OnlineScheduler(scheduler, io_ops);
+}
+
+OnlineScheduler::OnlineScheduler(Scheduler* scheduler_, IO_pool* io_ops_) {
+    scheduler = scheduler_;
+    io_ops = io_ops_;
+    nb_pending = 0;
+    created_ns = monotonic_ns();
+    epoch_ms = 0;
+}
+
+// The clock of the schedulers is in ms since the creation : the arrival time of a request is the time of its submit().
+// With 32-bit times it would overflow after 24.8 days. So once it passes MAX_TIME / 2, it restarts from 0 and the
+// arrival times of the requests not completed yet move back by as much : the waits, and so the deadlines, stay the same.
+// The requests already waiting for MAX_TIME / 2 stop at -MAX_TIME / 2, long past any deadline
+int64_t OnlineScheduler::now_ms() {
+    int64_t now = (monotonic_ns() - created_ns) / 1000000 - epoch_ms;
+    if (now > MAX_TIME / 2) {
+        for (map<uint64_t, op_index>::iterator it = slots.begin(); it != slots.end(); it++) {
+            int64_t arrival_time = io_ops->arrival_time[it->second] - now;
+            io_ops->arrival_time[it->second] = (io_time) max(arrival_time, (int64_t) -(MAX_TIME / 2));
+        }
+        epoch_ms += now;
+        now = 0;
+    }
+    return now;
+}
+
+OnlineScheduler::~OnlineScheduler() {
+    delete scheduler;
+    delete io_ops;
+}
+
+bool OnlineScheduler::submit(int64_t track, uint64_t tag) {
+    lock_guard<mutex> guard(lock);
+    if (track < 0 || track > MAX_TRACK || slots.count(tag) > 0) {
+        return false;
+    }
+    op_index io_op = io_ops->alloc(0, now_ms(), track);
+    if (tags.size() <= io_op) {
+        tags.resize(io_op + 1);
+        dispatched.resize(io_op + 1);
+    }
+    tags[io_op] = tag;
+    dispatched[io_op] = false;
+    slots[tag] = io_op;
+    scheduler->add_request(io_op);
+    nb_pending++;
+    return true;
+}
+
+bool OnlineScheduler::next(int64_t head, uint64_t* tag) {
+    lock_guard<mutex> guard(lock);
+    if (head < 0 || head > MAX_TRACK) {
+        return false;
+    }
+    scheduler->head = head;
+    scheduler->clock = now_ms();
+    op_index io_op = scheduler->strategy();
+    if (io_op == NO_OP) {
+        return false;
+    }
+    dispatched[io_op] = true;
+    nb_pending--;
+    *tag = tags[io_op];
+    return true;
+}
+
+bool OnlineScheduler::complete(uint64_t tag) {
+    lock_guard<mutex> guard(lock);
+    map<uint64_t, op_index>::iterator it = slots.find(tag);
+    if (it == slots.end() || !dispatched[it->second]) {
+        return false;
+    }
+    io_ops->release(it->second);
+    slots.erase(it);
+    return true;
+}
+
+size_t OnlineScheduler::pending() {
+    lock_guard<mutex> guard(lock);
+    return nb_pending;
+}
+
+size_t OnlineScheduler::in_flight() {
+    lock_guard<mutex> guard(lock);
+    return slots.size() - nb_pending;
+}
+
+}